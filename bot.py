@@ -12,6 +12,7 @@ import subprocess
 import sqlite3
 import random
 import json
+import socket
 from fuzzywuzzy import fuzz
 from fuzzywuzzy import process
 
@@ -19,6 +20,7 @@ SID = 1
 # Must be edited to suit your workstation.
 FILE_DIR = "/home/chrisnap/Backups/.tsbak/files/virtualserver_1/"
 SAYINGS_DIR = "./sayings/"
+LTC_SOCKET = "/tmp/ltc_sock"
 
 class BotCredentials:
     def __init__(self, credential_path):
@@ -243,15 +245,37 @@ def do_ltc(data):
         tsconn.global_msg("Usage: !ltc -d MM-DD-YYYY")
         return
 
-    p = subprocess.run(['./ltc/old_ltc/ltc', '-d', tokens[1], "./logs"],
-                                    capture_output=True, text=True)
-    if p.returncode != 0:
-        tsconn.global_msg("Usage: !ltc -d MM-DD-YYYY")
-        return
-
-    for line in p.stdout.splitlines():
+    output = query_ltc_server("since " + tokens[1])
+    if output is None:
+        p = subprocess.run(['./ltc/old_ltc/ltc', '-m', '-i', './ltc/old_ltc/ltc.idx',
+                            '-d', tokens[1], "./logs"],
+                           capture_output=True, text=True)
+        if p.returncode != 0:
+            tsconn.global_msg("Usage: !ltc -d MM-DD-YYYY")
+            return
+        output = p.stdout
+
+    for line in output.splitlines():
         tsconn.global_msg(line)
 
+def query_ltc_server(query):
+    # Ask an already running `ltc --serve` first, it answers much faster
+    # than starting ltc up. None means there is no server to ask.
+    try:
+        with socket.socket(socket.AF_UNIX, socket.SOCK_STREAM) as s:
+            s.settimeout(5)
+            s.connect(LTC_SOCKET)
+            s.sendall((query + "\n").encode())
+            resp = b""
+            while True:
+                chunk = s.recv(4096)
+                if not chunk:
+                    break
+                resp += chunk
+    except OSError:
+        return None
+    return resp.decode(errors="replace")
+
 
 def start():
     tsconn.listen_to_global_chat()
@@ -0,0 +1,341 @@
+/*
+ * Session analytics
+ *
+ * The totals kept for each client say nothing about *when* they were
+ * connected. With sessions being recorded (see SessionStore) every finished
+ * connection is still around, so time connected can be spread out over
+ * buckets of time instead:
+ * 	hour	- Hour of the day, 00 to 23
+ * 	weekday	- Day of the week, Sun to Sat
+ * 	day	- Every calendar day
+ * 	week	- Every week, starting on Monday
+ * or the sessions can be swept for the most that were open at once (peak).
+ * Server wide, the most clients online in every hour (online) comes from
+ * the OnlineCurve the database keeps as it goes.
+ *
+ * Buckets follow the clock the logs are written in, so "hour 18" holds
+ * whatever happened on lines stamped 18:xx.
+ *
+ * Each session is first cut down to the asked for window, which makes any
+ * window cheap to answer once the sessions are in memory.
+ */
+#include "ltc.h"
+
+static constexpr time_t SECS_PER_HOUR = 3600;
+static constexpr time_t SECS_PER_WEEK = 7 * SECS_PER_DAY;
+
+/* 1970-01-01 was a Thursday */
+static constexpr time_t SUNDAY_OFFSET = 4 * SECS_PER_DAY;
+static constexpr time_t MONDAY_OFFSET = 3 * SECS_PER_DAY;
+
+static const char *const WEEKDAY_NAMES[] = {
+	"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat",
+};
+
+/* wall_time - Time t on the clock the log lines are written in */
+static time_t wall_time(time_t t)
+{
+	return t - UTC_DIFF * SECS_PER_HOUR;
+}
+
+/*
+ * window_time - Move a date from parse_date_arg() onto the log's clock
+ *
+ * Dates are parsed as local midnight, but buckets are laid out on the clock
+ * the logs are written in, so a window starting on a date has to start at
+ * midnight there to line up with the buckets.
+ */
+static time_t window_time(time_t t)
+{
+	struct tm tm;
+
+	if (!t)
+		return 0;
+	localtime_r(&t, &tm);
+	return timegm(&tm) + UTC_DIFF * SECS_PER_HOUR;
+}
+
+/* pos_in_period - How far into its period, starting offset in, t is */
+static time_t pos_in_period(time_t t, time_t period, time_t offset)
+{
+	return ((t + offset) % period + period) % period;
+}
+
+/*
+ * add_periodic - Spread [start, end) over buckets repeating every period
+ *
+ * Whole periods add the same to every bucket, so only what is left over
+ * has to be walked bucket by bucket.
+ */
+static void add_periodic(std::vector<time_t> &buckets, time_t start, time_t end,
+			 time_t period, time_t offset)
+{
+	time_t width = period / buckets.size();
+	time_t full = (end - start) / period;
+
+	if (full) {
+		for (auto &b : buckets)
+			b += full * width;
+		start += full * period;
+	}
+	while (start < end) {
+		time_t pos = pos_in_period(start, period, offset);
+		time_t stop = std::min(start + width - pos % width, end);
+
+		buckets[pos / width] += stop - start;
+		start = stop;
+	}
+}
+
+/*
+ * add_calendar - Spread [start, end) over the width long buckets it touches
+ *
+ * Buckets are keyed by the time they start.
+ */
+static void add_calendar(std::map<time_t, time_t> &buckets, time_t start, time_t end,
+			 time_t width, time_t offset)
+{
+	while (start < end) {
+		time_t bucket = start - pos_in_period(start, width, offset);
+		time_t stop = std::min(bucket + width, end);
+
+		buckets[bucket] += stop - start;
+		start = stop;
+	}
+}
+
+/*
+ * clip_session - Cut a session down to the window in args
+ *
+ * Returns false if nothing of it is left, or it belongs to a client that
+ * was not asked for.
+ */
+static bool clip_session(const Session &s, const struct ProgArgs &args,
+			 time_t &start, time_t &end)
+{
+	if (args.client_filter && s.id != args.client_filter)
+		return false;
+	start = std::max(s.start, args.window_start);
+	end = args.window_end ? std::min(s.end, args.window_end) : s.end;
+	return start < end;
+}
+
+static void print_duration(std::ostream &out, time_t secs, bool time_in_seconds)
+{
+	std::string buf;
+
+	Client::format_duration(buf, secs, time_in_seconds);
+	out << buf;
+}
+
+static void print_date(std::ostream &out, time_t t, const char *fmt)
+{
+	struct tm tm;
+	char buf[32];
+
+	gmtime_r(&t, &tm);
+	strftime(buf, sizeof(buf), fmt, &tm);
+	out << buf;
+}
+
+static void print_periodic(std::ostream &out, const SessionStore &sessions,
+			   const struct ProgArgs &args)
+{
+	bool by_hour = args.analysis == Analysis::HOUR;
+	std::vector<time_t> buckets(by_hour ? 24 : 7);
+	time_t start, end;
+
+	for (const auto &s : sessions) {
+		if (!clip_session(s, args, start, end))
+			continue;
+		if (by_hour)
+			add_periodic(buckets, wall_time(start), wall_time(end),
+				     SECS_PER_DAY, 0);
+		else
+			add_periodic(buckets, wall_time(start), wall_time(end),
+				     SECS_PER_WEEK, SUNDAY_OFFSET);
+	}
+	for (size_t i = 0; i < buckets.size(); i++) {
+		if (by_hour)
+			out << std::setw(2) << std::setfill('0') << i << std::setfill(' ');
+		else
+			out << WEEKDAY_NAMES[i];
+		out << '\t';
+		print_duration(out, buckets[i], args.time_in_seconds);
+		out << '\n';
+	}
+}
+
+static void print_calendar(std::ostream &out, const SessionStore &sessions,
+			   const struct ProgArgs &args)
+{
+	bool by_week = args.analysis == Analysis::WEEK;
+	std::map<time_t, time_t> buckets;
+	time_t start, end;
+
+	for (const auto &s : sessions) {
+		if (!clip_session(s, args, start, end))
+			continue;
+		if (by_week)
+			add_calendar(buckets, wall_time(start), wall_time(end),
+				     SECS_PER_WEEK, MONDAY_OFFSET);
+		else
+			add_calendar(buckets, wall_time(start), wall_time(end),
+				     SECS_PER_DAY, 0);
+	}
+	for (const auto &[bucket, secs] : buckets) {
+		print_date(out, bucket, "%Y-%m-%d");
+		out << '\t';
+		print_duration(out, secs, args.time_in_seconds);
+		out << '\n';
+	}
+}
+
+/*
+ * print_peak - Print the most sessions open at once, and when that was first
+ *
+ * A session ending the same second another starts does not overlap it.
+ */
+static void print_peak(std::ostream &out, const SessionStore &sessions,
+		       const struct ProgArgs &args)
+{
+	std::vector<std::pair<time_t, int>> events;
+	unsigned int open = 0, peak = 0;
+	time_t peak_time = 0, start, end;
+
+	for (const auto &s : sessions) {
+		if (!clip_session(s, args, start, end))
+			continue;
+		events.emplace_back(start, 1);
+		events.emplace_back(end, -1);
+	}
+	std::sort(events.begin(), events.end());
+	for (const auto &[t, change] : events) {
+		open += change;
+		if (open > peak) {
+			peak = open;
+			peak_time = t;
+		}
+	}
+	out << peak;
+	if (peak) {
+		out << '\t';
+		print_date(out, wall_time(peak_time), "%Y-%m-%d %H:%M:%S");
+	}
+	out << '\n';
+}
+
+/*
+ * print_online - Print the most clients online during each hour
+ *
+ * Hours in which nobody was online are left out. This is about the server
+ * as a whole, so a client filter makes no difference to it.
+ */
+static void print_online(std::ostream &out, const OnlineCurve &curve,
+			 const struct ProgArgs &args)
+{
+	std::map<time_t, unsigned int> hours;
+	std::pair<time_t, unsigned int> prev(0, 0);
+
+	for (const auto &step : curve.steps()) {
+		time_t start = std::max(prev.first, args.window_start);
+		time_t end = args.window_end ? std::min(step.first, args.window_end) : step.first;
+
+		if (prev.second && start < end) {
+			time_t hour = wall_time(start) - pos_in_period(wall_time(start), SECS_PER_HOUR, 0);
+
+			for (; hour < wall_time(end); hour += SECS_PER_HOUR) {
+				unsigned int &most = hours[hour];
+
+				most = std::max(most, prev.second);
+			}
+		}
+		prev = step;
+	}
+	for (const auto &[hour, most] : hours) {
+		print_date(out, hour, "%Y-%m-%d %H:00");
+		out << '\t' << most << '\n';
+	}
+}
+
+/*
+ * parse_analysis_arg - Parse the name of an analysis, as given to -A
+ */
+bool parse_analysis_arg(const char *arg, Analysis &a)
+{
+	static const std::pair<const char *, Analysis> names[] = {
+		{ "hour", Analysis::HOUR },
+		{ "weekday", Analysis::WEEKDAY },
+		{ "day", Analysis::DAY },
+		{ "week", Analysis::WEEK },
+		{ "peak", Analysis::PEAK },
+		{ "online", Analysis::ONLINE },
+	};
+
+	for (const auto &[name, analysis] : names) {
+		if (!strcmp(arg, name)) {
+			a = analysis;
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * print_analysis - Print the analysis asked for in args
+ */
+void print_analysis(std::ostream &out, const ClientDatabase &db,
+		    const struct ProgArgs &window_args)
+{
+	const SessionStore &sessions = db.get_sessions();
+	struct ProgArgs args = window_args;
+
+	args.window_start = window_time(args.window_start);
+	args.window_end = window_time(args.window_end);
+	switch (args.analysis) {
+	case Analysis::HOUR:
+	case Analysis::WEEKDAY:
+		print_periodic(out, sessions, args);
+		break;
+	case Analysis::DAY:
+	case Analysis::WEEK:
+		print_calendar(out, sessions, args);
+		break;
+	case Analysis::PEAK:
+		print_peak(out, sessions, args);
+		break;
+	case Analysis::ONLINE:
+		print_online(out, db.get_online_curve(), args);
+		break;
+	case Analysis::NONE:
+	default:
+		break;
+	}
+}
+
+/*
+ * export_sessions - Write every recorded session out to path
+ *
+ * The file holds the name of every client, followed by the sessions as
+ * SessionStore saves them:
+ * 	magic, version
+ * 	number of clients, then (id, name) for each
+ * 	the sessions
+ */
+#define SESSIONS_MAGIC 0x5345534c /* "LSES" */
+#define SESSIONS_VERSION 1
+
+bool export_sessions(const std::string &path, const ClientDatabase &db)
+{
+	ByteWriter w;
+
+	w.put<uint32_t>(SESSIONS_MAGIC);
+	w.put<uint32_t>(SESSIONS_VERSION);
+	w.put_varint(db.size());
+	for (const Client &c : db) {
+		w.put_varint(c.get_id());
+		w.put_str(db.name_of(c));
+	}
+	db.get_sessions().save(w);
+	return w.write_to(path);
+}
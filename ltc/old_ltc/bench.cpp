@@ -0,0 +1,112 @@
+/*
+ * bench - Time ltc's parser over a log directory
+ *
+ * Runs compile_logs() and parse_files() over the logs, just like a plain
+ * ltc run but without printing anything, and reports:
+ * 	lines/sec, bytes/sec	- Averaged over every run
+ * 	allocs/run		- Calls to operator new during a run
+ * 	peak rss		- Of the whole process
+ * Takes the same -j and -m flags as ltc, plus -r for the number of runs.
+ * The output is one "name: value" a line, so two runs are easy to diff.
+ */
+#include <getopt.h>
+#include <sys/resource.h>
+#include "ltc.h"
+
+static std::atomic<unsigned long> num_allocs{0};
+static std::atomic<unsigned long> alloc_bytes{0};
+
+void *operator new(size_t size)
+{
+	void *p = malloc(size ? size : 1);
+
+	if (!p)
+		throw std::bad_alloc();
+	num_allocs.fetch_add(1, std::memory_order_relaxed);
+	alloc_bytes.fetch_add(size, std::memory_order_relaxed);
+	return p;
+}
+
+void operator delete(void *p) noexcept
+{
+	free(p);
+}
+
+void operator delete(void *p, size_t size) noexcept
+{
+	(void) size;
+	free(p);
+}
+
+/* count_input - Total bytes and lines over every log */
+static void count_input(const std::vector<LogFile> &logs, uint64_t &bytes, uint64_t &lines)
+{
+	bytes = lines = 0;
+	for (const auto &l : logs) {
+		MappedFile mf(l.file_path());
+		std::string_view data = mf.data();
+
+		bytes += data.size();
+		lines += std::count(data.begin(), data.end(), '\n');
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	struct ProgArgs args;
+	unsigned int runs = 3;
+	uint64_t bytes, lines;
+	unsigned long allocs, allocated;
+	std::chrono::duration<double> elapsed{0};
+	struct rusage ru;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "j:mr:")) != -1) {
+		switch (opt) {
+		case 'j':
+			args.num_jobs = std::max(1, atoi(optarg));
+			break;
+		case 'm':
+			args.use_mmap = true;
+			break;
+		case 'r':
+			runs = std::max(1, atoi(optarg));
+			break;
+		default:
+			std::cout << "Usage: bench [-j jobs] [-m] [-r runs] dir\n";
+			exit(1);
+		}
+	}
+	if (optind >= argc) {
+		std::cout << "Please input log directory\n";
+		exit(1);
+	}
+
+	count_input(compile_logs(argv[optind]), bytes, lines);
+	allocs = num_allocs;
+	allocated = alloc_bytes;
+	for (unsigned int i = 0; i < runs; i++) {
+		auto start = std::chrono::steady_clock::now();
+		ClientDatabase db;
+
+		parse_files(db, compile_logs(argv[optind]), args);
+		elapsed += std::chrono::steady_clock::now() - start;
+	}
+	allocs = (num_allocs - allocs) / runs;
+	allocated = (alloc_bytes - allocated) / runs;
+	getrusage(RUSAGE_SELF, &ru);
+
+	double secs = elapsed.count() / runs;
+	std::cout << std::fixed << std::setprecision(3)
+		<< "bytes: " << bytes << '\n'
+		<< "lines: " << lines << '\n'
+		<< "runs: " << runs << '\n'
+		<< "secs/run: " << secs << '\n'
+		<< std::setprecision(0)
+		<< "lines/sec: " << lines / secs << '\n'
+		<< "bytes/sec: " << bytes / secs << '\n'
+		<< "allocs/run: " << allocs << '\n'
+		<< "alloc bytes/run: " << allocated << '\n'
+		<< "peak rss kb: " << ru.ru_maxrss << '\n';
+	return 0;
+}
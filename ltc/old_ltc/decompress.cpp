@@ -0,0 +1,226 @@
+/*
+ * Compressed logs
+ *
+ * Old logs can be kept gzip compressed, or zstd compressed when built with
+ * LTC_HAVE_ZSTD (make ZSTD=1). They get decompressed on a thread of their
+ * own, which hands chunks of whole lines over a BoundedQueue to whoever is
+ * parsing. Decompressing the next chunk overlaps with parsing the last one,
+ * and the queue keeps the decompressor from running too far ahead.
+ */
+#include <zlib.h>
+#ifdef LTC_HAVE_ZSTD
+# include <zstd.h>
+#endif
+#include "ltc.h"
+
+/* Decompressed bytes handed over at once, and how many chunks can wait */
+#define CHUNK_SIZE (1 << 20)
+#define MAX_CHUNKS_AHEAD 4
+
+class Decompressor {
+public:
+	virtual ~Decompressor(void) { }
+
+	/*
+	 * read - Decompress up to len bytes into buf
+	 *
+	 * Returns how many bytes were decompressed, 0 at the end of the
+	 * stream, or -1 if the log is corrupt or cut short.
+	 */
+	virtual ssize_t read(char *buf, size_t len) = 0;
+};
+
+class GzipDecompressor : public Decompressor {
+public:
+	GzipDecompressor(const std::string &path) : file(gzopen(path.c_str(), "rb")) {
+		if (file)
+			gzbuffer(file, 128 * 1024);
+	}
+
+	~GzipDecompressor(void) {
+		if (file)
+			gzclose(file);
+	}
+
+	bool is_open(void) const {
+		return file != nullptr;
+	}
+
+	ssize_t read(char *buf, size_t len) override {
+		int err = Z_OK, nr = gzread(file, buf, len);
+		const char *msg = nullptr;
+
+		/*
+		 * A cut short log just ends early, only gzerror() tells. Its
+		 * message already starts with the path.
+		 */
+		if (nr <= 0)
+			msg = gzerror(file, &err);
+		if (nr < 0 || err != Z_OK) {
+			std::cerr << "Failed to decompress " << msg << '\n';
+			return -1;
+		}
+		return nr;
+	}
+
+private:
+	gzFile file;
+};
+
+#ifdef LTC_HAVE_ZSTD
+class ZstdDecompressor : public Decompressor {
+public:
+	ZstdDecompressor(const std::string &p) :
+		path(p),
+		fd(open(p.c_str(), O_RDONLY | O_CLOEXEC)),
+		stream(ZSTD_createDStream()),
+		in_buf(ZSTD_DStreamInSize()),
+		in{in_buf.data(), 0, 0},
+		last_ret(0)
+	{
+		ZSTD_initDStream(stream);
+	}
+
+	~ZstdDecompressor(void) {
+		if (fd >= 0)
+			close(fd);
+		ZSTD_freeDStream(stream);
+	}
+
+	bool is_open(void) const {
+		return fd >= 0;
+	}
+
+	ssize_t read(char *buf, size_t len) override {
+		ZSTD_outBuffer out = { buf, len, 0 };
+
+		while (out.pos == 0) {
+			if (in.pos == in.size) {
+				ssize_t nr = ::read(fd, in_buf.data(), in_buf.size());
+
+				if (nr < 0 && errno == EINTR)
+					continue;
+				if (nr < 0) {
+					std::cerr << "Failed to read '" << path << "': "
+						<< strerror(errno) << '\n';
+					return -1;
+				}
+				if (nr == 0) {
+					/* Anything but 0 means the last frame was cut short */
+					if (last_ret) {
+						std::cerr << "Failed to decompress '" << path
+							<< "': truncated\n";
+						return -1;
+					}
+					return 0;
+				}
+				in.size = nr;
+				in.pos = 0;
+			}
+			last_ret = ZSTD_decompressStream(stream, &out, &in);
+			if (ZSTD_isError(last_ret)) {
+				std::cerr << "Failed to decompress '" << path << "': "
+					<< ZSTD_getErrorName(last_ret) << '\n';
+				return -1;
+			}
+		}
+		return out.pos;
+	}
+
+private:
+	std::string path;
+	int fd;
+	ZSTD_DStream *stream;
+	std::vector<char> in_buf;
+	ZSTD_inBuffer in;
+
+	/* last_ret: What ZSTD_decompressStream() last returned */
+	size_t last_ret;
+};
+#endif
+
+static std::unique_ptr<Decompressor> open_decompressor(const LogFile &l)
+{
+	switch (l.compression()) {
+	case Compression::GZIP: {
+		auto d = std::make_unique<GzipDecompressor>(l.file_path());
+
+		if (d->is_open())
+			return d;
+		break;
+	}
+#ifdef LTC_HAVE_ZSTD
+	case Compression::ZSTD: {
+		auto d = std::make_unique<ZstdDecompressor>(l.file_path());
+
+		if (d->is_open())
+			return d;
+		break;
+	}
+#endif
+	default:
+		std::cerr << "Don't know how to decompress '" << l.file_path() << "'!\n";
+		return nullptr;
+	}
+	std::cerr << "Failed to open '" << l.file_path() << "': "
+		<< strerror(errno) << '\n';
+	return nullptr;
+}
+
+/*
+ * stream_log - Decompress a log, handing it to consume a chunk at a time
+ *
+ * Every chunk ends right after a newline (other than maybe the last), so a
+ * line is never split between two of them. consume runs on the calling
+ * thread.
+ *
+ * Returns false if the log could not be decompressed all the way through.
+ * Whatever came before the problem has been consumed already.
+ */
+bool stream_log(const LogFile &l, const std::function<void(std::string_view)> &consume)
+{
+	std::unique_ptr<Decompressor> d = open_decompressor(l);
+	BoundedQueue<std::string> chunks(MAX_CHUNKS_AHEAD);
+	std::string chunk;
+	bool failed = false;
+
+	if (!d)
+		return false;
+
+	std::thread producer([&]() {
+		std::string carry;
+
+		for (;;) {
+			std::string buf = std::move(carry);
+			size_t have = buf.size(), last_nl;
+			ssize_t nr;
+
+			buf.resize(have + CHUNK_SIZE);
+			nr = d->read(buf.data() + have, CHUNK_SIZE);
+			if (nr <= 0) {
+				failed = nr < 0;
+				buf.resize(have);
+				if (!buf.empty())
+					chunks.push(std::move(buf));
+				break;
+			}
+			buf.resize(have + nr);
+
+			/* Hold on to any partial line until the rest shows up */
+			last_nl = buf.rfind('\n');
+			if (last_nl == std::string::npos) {
+				carry = std::move(buf);
+				continue;
+			}
+			carry.assign(buf, last_nl + 1);
+			buf.resize(last_nl + 1);
+			chunks.push(std::move(buf));
+		}
+		chunks.close();
+	});
+
+	while (chunks.pop(chunk))
+		consume(chunk);
+	producer.join();
+	return !failed;
+}
@@ -0,0 +1,205 @@
+/*
+ * Event store
+ *
+ * Almost all of a teamspeak log is noise as far as ltc is concerned.
+ * `ltc import` boils the logs down once to just their client (dis)connects,
+ * and -E then runs the usual accounting over those instead of the logs.
+ *
+ * Events are kept a log at a time, since clients are reset between logs,
+ * and each log is stored a column at a time:
+ * 	magic, version
+ * 	number of names, then each name
+ * 	number of logs, then for each:
+ * 		name, number of events, time of the last line, size of the columns
+ * 		time	- Zigzag deltas from the one before, the first from 0
+ * 		id	- Varints
+ * 		type	- A bit per event, set for a connect
+ * 		name	- Index into the names, for connects only
+ * Events in a log are nearly in time order and clients keep the same few
+ * names, so most of an event fits in three or four bytes. The time of the
+ * last line lets a log that is too old for -d be skipped without decoding
+ * it, and is where --close-at-end closes whatever was left open.
+ */
+#include "ltc.h"
+
+#define EVENTS_MAGIC 0x5356454c /* "LEVS" */
+#define EVENTS_VERSION 2
+
+/*
+ * encode_log - Append the columns of one log's events to w
+ */
+static void encode_log(ByteWriter &w, const std::vector<LogEvent> &events,
+		       std::unordered_map<std::string_view, uint32_t> &refs,
+		       std::vector<std::string_view> &names)
+{
+	time_t prev = 0;
+	uint8_t bits = 0;
+	size_t i;
+
+	for (const auto &e : events) {
+		int64_t delta = e.time - prev;
+
+		w.put_varint(((uint64_t) delta << 1) ^ (uint64_t) (delta >> 63));
+		prev = e.time;
+	}
+	for (const auto &e : events)
+		w.put_varint(e.id);
+	for (i = 0; i < events.size(); i++) {
+		bits |= events[i].connect << (i % 8);
+		if (i % 8 == 7 || i + 1 == events.size()) {
+			w.put<uint8_t>(bits);
+			bits = 0;
+		}
+	}
+	for (const auto &e : events) {
+		if (!e.connect)
+			continue;
+
+		auto [it, added] = refs.try_emplace(e.name, names.size());
+		if (added)
+			names.push_back(e.name);
+		w.put_varint(it->second);
+	}
+}
+
+/*
+ * import_events - Write the (dis)connects in logs out to an event store at path
+ */
+bool import_events(const std::string &path, const std::vector<LogFile> &logs)
+{
+	std::unordered_map<std::string_view, uint32_t> refs;
+	std::vector<std::string_view> names;
+	std::vector<LogEvent> events;
+	NameArena arena;
+	ByteWriter body, w;
+
+	for (const auto &l : logs) {
+		ByteWriter columns;
+		time_t max_time = 0;
+
+		events.clear();
+		max_time = read_log_events(l, [&](const LogEvent &e) {
+			events.push_back(e);
+			/* The name points into the log, which is gone once it's read */
+			if (e.connect)
+				events.back().name = arena.intern(e.name);
+		});
+		for (const auto &e : events)
+			max_time = std::max(max_time, e.time);
+		max_time = std::max<time_t>(max_time, 0);
+		encode_log(columns, events, refs, names);
+
+		body.put_str(l.log_name());
+		body.put_varint(events.size());
+		body.put_varint(max_time);
+		body.put_varint(columns.data().size());
+		body.put_bytes(columns.data());
+	}
+
+	w.put<uint32_t>(EVENTS_MAGIC);
+	w.put<uint32_t>(EVENTS_VERSION);
+	w.put_varint(names.size());
+	for (auto name : names)
+		w.put_str(name);
+	w.put_varint(logs.size());
+	w.put_bytes(body.data());
+	return w.write_to(path);
+}
+
+/*
+ * replay_log - Run the events of one log through db, just as parsing it would
+ */
+static void replay_log(ClientDatabase &db, std::string_view columns, uint64_t n,
+		       const std::vector<std::string_view> &names, time_t time_constraint)
+{
+	ByteReader r(columns);
+	std::vector<time_t> times;
+	std::vector<Client::client_id> ids;
+	std::string_view types;
+	time_t prev = 0;
+	uint64_t i;
+
+	/* Every event takes at least a byte for its time and one for its id */
+	if (n > columns.size() / 2)
+		throw std::runtime_error("Bad event count!");
+	times.resize(n);
+	ids.resize(n);
+
+	for (i = 0; i < n; i++) {
+		uint64_t zz = r.get_varint();
+
+		prev += (int64_t) ((zz >> 1) ^ -(zz & 1));
+		times[i] = prev;
+	}
+	for (i = 0; i < n; i++)
+		ids[i] = r.get_varint();
+	types = r.get_bytes((n + 7) / 8);
+
+	STAT_TIME(STAT_DB_TIME);
+	for (i = 0; i < n; i++) {
+		bool connect = (types[i / 8] >> (i % 8)) & 1;
+		uint64_t ref = connect ? r.get_varint() : 0;
+
+		if (times[i] < time_constraint)
+			continue;
+		if (!connect) {
+			db.log_disconn(ids[i], times[i]);
+			continue;
+		}
+		if (ref >= names.size())
+			throw std::runtime_error("Bad name reference!");
+		db.log_conn(names[ref], ids[i], times[i]);
+	}
+}
+
+/*
+ * parse_event_store - Parse the event store at path into db
+ *
+ * Ends up with the same totals as parse_files() would have over the logs
+ * it was imported from.
+ */
+bool parse_event_store(ClientDatabase &db, const std::string &path, time_t time_constraint)
+{
+	MappedFile mf(path);
+	ByteReader r(mf.data());
+	std::vector<std::string_view> names;
+	STAT_TIME(STAT_SCAN_TIME);
+
+	if (mf.data().empty())
+		return false;
+	try {
+		uint64_t n;
+
+		if (r.get<uint32_t>() != EVENTS_MAGIC ||
+		    r.get<uint32_t>() != EVENTS_VERSION)
+			throw std::runtime_error("Not an event store!");
+		n = r.get_varint();
+		while (n--)
+			names.push_back(r.get_str());
+		n = r.get_varint();
+		while (n--) {
+			uint64_t num_events;
+			time_t max_time;
+			std::string_view columns;
+
+			r.get_str();
+			num_events = r.get_varint();
+			max_time = r.get_varint();
+			columns = r.get_bytes(r.get_varint());
+			STAT_ADD(STAT_FILES, 1);
+			STAT_ADD(STAT_BYTES, columns.size());
+
+			/* Nothing in the log counts, so it can't leave anything behind */
+			if (max_time < time_constraint)
+				continue;
+			replay_log(db, columns, num_events, names, time_constraint);
+			db.saw_time(max_time);
+			db.reset_clients();
+		}
+	} catch (std::runtime_error &e) {
+		std::cerr << "Failed to read event store '" << path << "': "
+			<< e.what() << '\n';
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,252 @@
+/*
+ * genlogs - Write made up teamspeak logs, for benchmarking ltc
+ *
+ * Clients come and go on a daily rhythm, mostly in the evening. The server
+ * is restarted every few days, which starts a new log, and anyone still
+ * connected at that point never gets a disconnect line, just like the real
+ * logs. On top of that:
+ * 	-r	- Chance a connection is joined by a second one under a
+ * 		  duplicate nickname ('Bob' and 'Bob1' with the same id)
+ * 	-m	- Chance a disconnect line goes missing
+ * 	-n	- Lines of noise (channel edits, query logins, ...) per
+ * 		  (dis)connect line
+ * The same seed always gives the same logs.
+ */
+#include <getopt.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#define SECS_PER_DAY 86400
+
+struct GenArgs {
+	unsigned int clients;
+	unsigned int days;
+	unsigned int days_per_log;
+	double dup_rate;
+	double missing_rate;
+	double noise;
+	unsigned long seed;
+	time_t start;
+
+	GenArgs(void) :
+		clients(100),
+		days(30),
+		days_per_log(7),
+		dup_rate(0.05),
+		missing_rate(0.01),
+		noise(2),
+		seed(1),
+		start(1577836800) /* 2020-01-01 */
+	{ }
+};
+
+struct Event {
+	time_t time;
+	unsigned int usec;
+	bool connect;
+	unsigned int id;
+	std::string name;
+
+	bool operator<(const Event &e) const {
+		if (time != e.time)
+			return time < e.time;
+		return usec < e.usec;
+	}
+};
+
+static const char *const BASE_NAMES[] = {
+	"Bob", "alice", "Tim the Great", "cnap", "evan", "mike", "tosco", "zed",
+	"xX_sniper_Xx", "Ω名", "o'brien", "dave",
+};
+
+static const char *const NOISE_LINES[] = {
+	"|INFO    |VirtualServer |1  |channel 'Lobby' edited by 'admin'(id:3)",
+	"|INFO    |VirtualServer |1  |query client connected 'serveradmin'(id:1)",
+	"|INFO    |VirtualServer |1  |query client disconnected 'serveradmin'(id:1) reason 'reasonmsg=disconnecting'",
+	"|INFO    |Accounting    |   |Licensing Information",
+	"|INFO    |VirtualServer |1  |client 'alice'(id:12) was moved to channel 'AFK'",
+	"|WARNING |VirtualServer |1  |client 'evan'(id:9) failed to upload file",
+	"|INFO    |FileManager   |   |file upload started by client 'mike'(id:7)",
+};
+
+static void write_time(std::ostream &out, time_t t, unsigned int usec, const char *fmt)
+{
+	struct tm tm;
+	char buf[64];
+
+	gmtime_r(&t, &tm);
+	strftime(buf, sizeof(buf), fmt, &tm);
+	out << buf;
+	snprintf(buf, sizeof(buf), ".%06u", usec);
+	out << buf;
+}
+
+/*
+ * gen_log - Make up the (dis)connects of one log, covering [from, to)
+ */
+static std::vector<Event> gen_log(const GenArgs &args, std::mt19937_64 &rng,
+				  std::vector<std::string> &names, time_t from, time_t to)
+{
+	std::uniform_real_distribution<double> chance(0, 1);
+	std::uniform_int_distribution<unsigned int> usec(0, 999999);
+	std::normal_distribution<double> evening(20 * 3600, 3 * 3600);
+	std::exponential_distribution<double> length(1.0 / 5400);
+	std::vector<Event> events;
+
+	for (unsigned int c = 0; c < args.clients; c++) {
+		unsigned int id = c + 2;
+		/* Some clients are on every day, some hardly ever */
+		double activity = 0.05 + 0.9 * ((c * 2654435761u) % 1000) / 1000.0;
+
+		for (time_t day = from - from % SECS_PER_DAY; day < to; day += SECS_PER_DAY) {
+			if (chance(rng) > activity)
+				continue;
+
+			time_t start = day + (time_t) std::clamp(evening(rng), 0.0, SECS_PER_DAY - 1.0);
+			time_t end = start + 60 + (time_t) length(rng);
+
+			if (start < from || start >= to)
+				continue;
+			if (chance(rng) < 0.02)
+				names[c] = std::string(BASE_NAMES[rng() % std::size(BASE_NAMES)]) +
+					   std::to_string(rng() % 100);
+			events.push_back({start, usec(rng), true, id, names[c]});
+			if (chance(rng) < args.dup_rate) {
+				time_t dup = start + (end - start) / 3;
+
+				events.push_back({dup, usec(rng), true, id, names[c] + "1"});
+				if (dup + (end - start) / 3 < to)
+					events.push_back({dup + (end - start) / 3, usec(rng),
+							  false, id, names[c] + "1"});
+			}
+			/* Still on when the server went down, or the line got lost */
+			if (end < to && chance(rng) >= args.missing_rate)
+				events.push_back({end, usec(rng), false, id, names[c]});
+		}
+	}
+	std::sort(events.begin(), events.end());
+	return events;
+}
+
+static void write_log(const GenArgs &args, std::mt19937_64 &rng, const std::string &dir,
+		      time_t from, const std::vector<Event> &events)
+{
+	std::uniform_real_distribution<double> chance(0, 1);
+	std::ofstream out;
+	std::string path;
+	{
+		std::ostringstream name;
+
+		name << dir << "/ts3server_";
+		write_time(name, from, 0, "%Y-%m-%d__%H_%M_%S");
+		name << "_1.log";
+		path = name.str();
+	}
+
+	out.open(path, std::ios::trunc);
+	if (!out) {
+		std::cerr << "Failed to open '" << path << "'\n";
+		exit(1);
+	}
+	for (const auto &e : events) {
+		double noise = args.noise;
+
+		for (; noise > 0 && chance(rng) < noise; noise -= 1) {
+			write_time(out, e.time, e.usec, "%Y-%m-%d %H:%M:%S");
+			out << NOISE_LINES[rng() % std::size(NOISE_LINES)] << '\n';
+		}
+		write_time(out, e.time, e.usec, "%Y-%m-%d %H:%M:%S");
+		out << "|INFO    |VirtualServerBase|1  |client "
+			<< (e.connect ? "connected '" : "disconnected '")
+			<< e.name << "'(id:" << e.id << ")";
+		if (e.connect)
+			out << " from 10.0." << e.id / 256 % 256 << '.' << e.id % 256 << ":5555\n";
+		else
+			out << " reason 'reasonmsg=leaving'\n";
+	}
+}
+
+static double get_num(const char *arg, char option)
+{
+	char *end;
+	double val = strtod(arg, &end);
+
+	if (end == arg || *end || val < 0) {
+		std::cout << "Bad value '" << arg << "' for option '" << option << "'\n";
+		exit(1);
+	}
+	return val;
+}
+
+int main(int argc, char *argv[])
+{
+	std::vector<std::string> names;
+	struct GenArgs args;
+	size_t logs = 0, events = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "c:d:l:m:n:r:s:")) != -1) {
+		switch (opt) {
+		case 'c':
+			args.clients = get_num(optarg, opt);
+			break;
+		case 'd':
+			args.days = get_num(optarg, opt);
+			break;
+		case 'l':
+			args.days_per_log = std::max(1.0, get_num(optarg, opt));
+			break;
+		case 'm':
+			args.missing_rate = get_num(optarg, opt);
+			break;
+		case 'n':
+			args.noise = get_num(optarg, opt);
+			break;
+		case 'r':
+			args.dup_rate = get_num(optarg, opt);
+			break;
+		case 's':
+			args.seed = get_num(optarg, opt);
+			break;
+		default:
+			std::cout << "Usage: genlogs [-c clients] [-d days] [-l days per log]\n"
+				"\t[-r duplicate rate] [-m missing rate] [-n noise] [-s seed] dir\n";
+			exit(1);
+		}
+	}
+	if (optind >= argc) {
+		std::cout << "Please input log directory\n";
+		exit(1);
+	}
+
+	std::string dir = argv[optind];
+	std::mt19937_64 rng(args.seed);
+	time_t end = args.start + (time_t) args.days * SECS_PER_DAY;
+
+	mkdir(dir.c_str(), 0755);
+	for (unsigned int c = 0; c < args.clients; c++)
+		names.push_back(std::string(BASE_NAMES[c % std::size(BASE_NAMES)]) +
+				(c < std::size(BASE_NAMES) ? "" : std::to_string(c)));
+	for (time_t from = args.start; from < end; logs++) {
+		/* Restarts happen at some odd time of the day */
+		time_t to = std::min<time_t>(end, from + (time_t) args.days_per_log * SECS_PER_DAY +
+					     rng() % 7200);
+		std::vector<Event> ev = gen_log(args, rng, names, from, to);
+
+		write_log(args, rng, dir, from, ev);
+		events += ev.size();
+		from = to + 60;
+	}
+	std::cout << "Wrote " << events << " (dis)connects over " << logs
+		<< " logs to " << dir << '\n';
+	return 0;
+}
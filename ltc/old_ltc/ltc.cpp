@@ -1,292 +1,325 @@
-#include <bits/stdc++.h>
-#include <time.h>
-
-#include <algorithm>
-#include <charconv>
-#include <fstream>
-#include <iostream>
-#include <unordered_map>
-#include <vector>
+#include <sys/syscall.h>
+#if defined(__x86_64__) || defined(__i386__)
+# include <immintrin.h>
+#endif
+#include "ltc.h"
 
 /*
- * Basic representation of a teamspeak log file
+ * Timestamp decoding
+ *
+ * Teamspeak only ever writes timestamps one way, so rather than going
+ * through strptime() (which has to deal with locales and every format under
+ * the sun) the fields are pulled straight out of their fixed positions:
+ * 	YYYY-MM-DD?HH?MM?SS
+ * where the separator between the date and the time, and between the time
+ * fields, depends on whether it is a log line or a file name.
  */
-class LogFile {
-public:
-	LogFile(time_t t, const std::string &n) : time(t), path(n) { }
-
-	LogFile(time_t t, const std::string &&n) : time(t), path(std::move(n)) { }
-
-	bool operator<(const LogFile &b) const {
-		return time < b.time;
-	}
-
-	bool operator>(const LogFile &b) const {
-		return time > b.time;
-	}
-
-	const std::string& file_path(void) const {
-		return path;
-	}
+struct TimeLayout {
+	/* gap: What sits between the date and the time */
+	std::string_view gap;
 
-private:
-	/* time: Time the file was created */
-	time_t time;
-
-	/* path: Path to the file in the directory */
-	std::string path;
+	/* time_sep: What sits between the hours, minutes and seconds */
+	char time_sep;
 };
 
+/* 2021-03-04 18:22:11.123456|INFO ... */
+static constexpr TimeLayout LINE_TIME_LAYOUT = { " ", ':' };
+/* ts3server_2021-03-04__18_22_11.123456_1.log (past the prefix) */
+static constexpr TimeLayout FILE_TIME_LAYOUT = { "__", '_' };
+static constexpr std::string_view LOG_FILE_PREFIX = "ts3server_";
+
 /*
- * Representation of a client connecting to the server.
+ * days_from_civil - Number of days between 1970-01-01 and y-m-d
+ *
+ * Exact for any date on the proleptic gregorian calendar. This is Howard
+ * Hinnant's algorithm: shifting the year to start in March puts the leap day
+ * at the very end, which makes the day of the year a simple linear function
+ * of the month.
  */
-class Client {
-public:
-	Client(const std::string &nickname, time_t time) :
-		last_time_connected(time),
-		total_time_connected(0),
-		num_conn(1),
-		name(nickname)
-	{ }
-
-	Client(const std::string &&nickname, time_t time) :
-		last_time_connected(time),
-		total_time_connected(0),
-		num_conn(1),
-		name(std::move(nickname))
-	{ }
-
-	void log_conn(const std::string &&logged_name, time_t t) {
-		/*
-		 * ONLY update the client if this is a fresh connection to
-		 * the server.
-		 */
-		if (++num_conn == 1) {
-			last_time_connected = t;
-			if (name.compare(logged_name))
-				name = std::move(logged_name);
-		}
-	}
+static constexpr long days_from_civil(long y, unsigned int m, unsigned int d)
+{
+	y -= m <= 2;
+	const long era = (y >= 0 ? y : y - 399) / 400;
+	const unsigned int yoe = (unsigned int) (y - era * 400);
+	const unsigned int doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+	const unsigned int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
 
-	/*
-	 * Notes about the if's in this function:
-	 * There seems to be a strange problem with very old teamspeak logs. It
-	 * seems not all (dis)connections have been logged. This causes the parser to
-	 * see things like:
-	 * 	(client) : disconnected
-	 * 	(client) : disconnected
-	 *
-	 * 	instead of...
-	 * 	(client) : connected
-	 * 	(client) : disconnected
-	 *
-	 * This strange behavior causes c->total_time += time_discon - c->last_conn_time
-	 * to accidentally grow very large. The best solution I can work out is just
-	 * ignore these values because we can't reliably tell when they actually
-	 * connected. Thus, on every disconnection set their last connection time to 0
-	 * so if we come across consecutive disconnects the data won't be too crazy.
-	 */
-	void log_disconn(time_t t) {
-		if (num_conn) {
-			if (last_time_connected && num_conn == 1) {
-				total_time_connected += t - last_time_connected;
-				last_time_connected = 0;
-			}
-			num_conn--;
-		}
-	}
+	return era * 146097 + (long) doe - 719468;
+}
 
-	/* Reset the client's connection fields */
-	void reset(void) {
-		num_conn = 0;
-		last_time_connected = 0;
-	}
+/*
+ * digits - Value of the n decimal digits at s
+ *
+ * Any byte that isn't a digit sets bad rather than branching out early,
+ * since the whole timestamp gets checked for it at once anyway.
+ */
+static constexpr unsigned int digits(const char *s, int n, unsigned int &bad)
+{
+	unsigned int val = 0;
 
-	bool operator<(const Client &c) const {
-		return total_time_connected < c.total_time_connected;
-	}
+	while (n--) {
+		unsigned int d = (unsigned char) *s++ - '0';
 
-	bool operator>(const Client &c) const {
-		return total_time_connected > c.total_time_connected;
+		bad |= d > 9;
+		val = val * 10 + d;
 	}
+	return val;
+}
 
-	void print_client_time(bool time_in_seconds) const {
-		time_t secs = total_time_connected;
-		time_t SECS_IN_HOUR = 3600;
-		time_t SECS_IN_DAY = SECS_IN_HOUR * 24;
+/*
+ * parse_time - Convert a fixed layout timestamp into seconds
+ *
+ * Returns -1 if str does not start with a valid timestamp.
+ */
+static constexpr time_t parse_time(std::string_view str, const TimeLayout &layout)
+{
+	const size_t date_len = 10, time_len = 8;
+	unsigned int bad = 0;
 
-		if (time_in_seconds) {
-			std::cout << secs;
-		} else {
-			unsigned long days, hrs, mins;
+	if (str.size() < date_len + layout.gap.size() + time_len)
+		return -1;
 
-			days = secs / SECS_IN_DAY;
-			secs -= days * SECS_IN_DAY;
-			hrs = secs / SECS_IN_HOUR;
-			secs -= hrs * SECS_IN_HOUR;
-			mins = secs / 60;
-			secs -= mins * 60;
-			std::cout
-				<< days << "d "
-				<< hrs  << "h "
-				<< mins << "m "
-				<< secs << "s";
-		}
-		std::cout << "\t" << name << "\n";
-	}
+	const char *s = str.data(), *t = s + date_len + layout.gap.size();
+	const unsigned int year = digits(s, 4, bad);
+	const unsigned int mon = digits(s + 5, 2, bad);
+	const unsigned int day = digits(s + 8, 2, bad);
+	const unsigned int hour = digits(t, 2, bad);
+	const unsigned int min = digits(t + 3, 2, bad);
+	const unsigned int sec = digits(t + 6, 2, bad);
+
+	bad |= (s[4] != '-') | (s[7] != '-');
+	bad |= (t[2] != layout.time_sep) | (t[5] != layout.time_sep);
+	for (size_t i = 0; i < layout.gap.size(); i++)
+		bad |= s[date_len + i] != layout.gap[i];
+	bad |= (mon - 1 > 11) | (day - 1 > 30) | (hour > 23) | (min > 59) | (sec > 60);
+	if (bad)
+		return -1;
 
-private:
-	/*
-	 * last_time_connected: Keeps track of when the most recent time the
-	 * client connected to the server.
-	 */
-	time_t last_time_connected;
+	return days_from_civil(year, mon, day) * 86400 +
+		(hour + UTC_DIFF) * 3600 + min * 60 + sec;
+}
 
-	/*
-	 * total_time_connected: Keeps track of the total time spent connected
-	 * across multiple disconnects.
-	 */
-	time_t total_time_connected;
+static_assert(days_from_civil(1970, 1, 1) == 0);
+static_assert(days_from_civil(2000, 3, 1) - days_from_civil(2000, 2, 28) == 2);
+static_assert(days_from_civil(1900, 3, 1) - days_from_civil(1900, 2, 28) == 1);
+static_assert(days_from_civil(2024, 1, 1) == 19723);
+static_assert(parse_time("1970-01-01 00:00:00", LINE_TIME_LAYOUT) == UTC_DIFF * 3600);
+static_assert(parse_time("2021-03-04 18:22:11.123456|INFO", LINE_TIME_LAYOUT) ==
+	      1614882131 + UTC_DIFF * 3600);
+static_assert(parse_time("2021-03-04__18_22_11.123456_1.log", FILE_TIME_LAYOUT) ==
+	      1614882131 + UTC_DIFF * 3600);
+static_assert(parse_time("2021-03-04 18:22:11", FILE_TIME_LAYOUT) == -1);
+static_assert(parse_time("2021-13-04 18:22:11", LINE_TIME_LAYOUT) == -1);
+static_assert(parse_time("2021-03-04 18:2", LINE_TIME_LAYOUT) == -1);
+static_assert(parse_time("2021-03-04 1a:22:11", LINE_TIME_LAYOUT) == -1);
 
-	/*
-	 * num_conn: The number of concurrent connections the client currently
-	 * has. e.g, if 'Bob' joins under the name 'Bob' and then rejoins the
-	 * same server 'Bob1' will show up in the logs with the same id.
-	 * This leaves us with:
-	 * 	'Bob' (last_time_connected: 30)
-	 * 	'Bob1' (last_time_connected: 65) <- We don't want that time.
-	 * However, we don't want to lost track of the total time connected
-	 * if one of these two connections disconnect. This member solves this
-	 * issue.
-	 */
-	unsigned int num_conn;
+/*
+ * log_time_now - The current time, on the same scale parse_time() puts
+ * log timestamps on. Teamspeak writes its timestamps in UTC.
+ */
+time_t log_time_now(void)
+{
+	return time(nullptr) + UTC_DIFF * 3600;
+}
 
-	/* name: Most recent name the client has used on the teamspeak. */
-	std::string name;
+/*
+ * LogDirent - The head of each record getdents64() fills its buffer with
+ */
+struct LogDirent {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
 };
 
 /*
- * Database of all client connections
+ * list_logs - Every log in dir, in no particular order
+ *
+ * The directory is read straight through getdents64(), a buffer full of
+ * entries per system call, and only names that look like logs ever get a
+ * path built for them.
  */
-class ClientDatabase {
-	using client_id = unsigned int;
-public:
-	void log_conn(const std::string &&name, client_id id, time_t t) {
-		auto res = client_map.find(id);
-
-		if (res != client_map.end())
-			res->second.log_conn(std::move(name), t);
-		else
-			client_map.insert(
-				std::pair<client_id, Client>(id, Client(std::move(name), t))
-			);
+static std::vector<LogFile> list_logs(const std::string &dir)
+{
+	std::vector<LogFile> logs;
+	std::vector<char> buf(256 * 1024);
+	std::string prefix = dir;
+	long nr;
+	int fd;
+
+	if (prefix.empty() || prefix.back() != '/')
+		prefix.push_back('/');
+	fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0) {
+		std::cerr << "Failed to open log directory '" << dir << "': "
+			<< strerror(errno) << '\n';
+		exit(1);
 	}
-
-	/*
-	 * Update client node with duration they were connected
-	 */
-	void log_disconn(client_id id, time_t t) {
-		auto res = client_map.find(id);
-
-		if (res != client_map.end())
-			res->second.log_disconn(t);
+	while ((nr = syscall(SYS_getdents64, fd, buf.data(), buf.size())) > 0) {
+		for (long pos = 0; pos < nr; ) {
+			const auto *d = reinterpret_cast<const LogDirent *>(buf.data() + pos);
+			std::string_view name = d->d_name;
+			time_t log_ctime = -1;
+
+			pos += d->d_reclen;
+			if (name.find("_1.log") == std::string_view::npos)
+				continue;
+			if (name.substr(0, LOG_FILE_PREFIX.size()) == LOG_FILE_PREFIX)
+				log_ctime = parse_time(name.substr(LOG_FILE_PREFIX.size()),
+						FILE_TIME_LAYOUT);
+			if (log_ctime < 0) {
+				std::cerr
+					<< "Failed to parse time for file '"
+					<< prefix << name
+					<< "'!\n";
+				exit(1);
+			}
+			logs.emplace_back(log_ctime, prefix + std::string(name));
+#ifndef LTC_HAVE_ZSTD
+			if (logs.back().compression() == Compression::ZSTD) {
+				std::cerr << "Skipping '" << logs.back().file_path()
+					<< "', ltc was built without zstd support\n";
+				logs.pop_back();
+			}
+#endif
+		}
 	}
-
-	/*
-	 * Reset all client's connections. This is important to do because there
-	 * are logs in which not all clients are shown disconnecting before the
-	 * end of the file. This behavior (I believe) is due to the fact that
-	 * the server could have crashed or forced shutdown.
-	 */
-	void reset_clients(void) {
-		for (auto it = client_map.begin(); it != client_map.end(); it++)
-			it->second.reset();
+	if (nr < 0) {
+		std::cerr << "Failed to read log directory '" << dir << "': "
+			<< strerror(errno) << '\n';
+		exit(1);
 	}
+	close(fd);
+	return logs;
+}
 
-	std::unordered_map<client_id, Client>::const_iterator begin(void) const {
-		return client_map.begin();
-	}
+/*
+ * Manifest
+ *
+ * Creating, removing or renaming a log all change the mtime of the log
+ * directory, so as long as that stays put, so does the list of logs. With
+ * -M, compile_logs() saves the list it comes up with next to the mtime,
+ * and hands the list straight back while the mtime still matches:
+ * 	magic, version
+ * 	directory, its mtime
+ * 	number of logs, then (file name, creation time) for each, in order
+ */
+#define MANIFEST_MAGIC 0x4e414d4c /* "LMAN" */
+#define MANIFEST_VERSION 1
 
-	std::unordered_map<client_id, Client>::const_iterator end(void) const {
-		return client_map.end();
+static bool load_manifest(const char *path, const std::string &dir,
+			  const struct stat &st, std::vector<LogFile> &logs)
+{
+	MappedFile mf(path, MappedFile::SAVED);
+	ByteReader r(mf.data());
+	std::string prefix = dir;
+
+	if (mf.data().empty())
+		return false;
+	if (prefix.empty() || prefix.back() != '/')
+		prefix.push_back('/');
+	try {
+		uint64_t n;
+
+		if (r.get<uint32_t>() != MANIFEST_MAGIC ||
+		    r.get<uint32_t>() != MANIFEST_VERSION ||
+		    r.get_str() != dir ||
+		    r.get<int64_t>() != st.st_mtim.tv_sec ||
+		    r.get<int64_t>() != st.st_mtim.tv_nsec)
+			return false;
+		n = r.get_varint();
+		logs.clear();
+		while (n--) {
+			std::string name = prefix + std::string(r.get_str());
+
+			logs.emplace_back(r.get<int64_t>(), std::move(name));
+		}
+	} catch (std::runtime_error &e) {
+		std::cerr << "Ignoring manifest '" << path << "': "
+			<< e.what() << '\n';
+		logs.clear();
+		return false;
 	}
-private:
-	/* client_map: Unordered mapping of unique client id's to a Client */
-	std::unordered_map<client_id, Client> client_map;
-};
-
-struct ProgArgs {
-	time_t time_constraint;
-	unsigned int tail_count;
-	unsigned int head_count;
-	bool time_in_seconds;
-
-	ProgArgs(void) :
-		time_constraint(0),
-		tail_count(0),
-		head_count(0),
-		time_in_seconds(false)
-	{ }
-};
-
-static ClientDatabase db;
+	return true;
+}
 
-#define UTC_DIFF 5
-static time_t str_to_time(const char *time_str, const char *fmt)
+static void save_manifest(const char *path, const std::string &dir,
+			  const struct stat &st, const std::vector<LogFile> &logs)
 {
-	struct tm tm = {0};
-	long tyears, tdays, leaps, utc_hrs;
+	struct timespec now;
+	ByteWriter w;
+
 	/*
-	 * days_past_since_jan[x] = # days past in the year where
-	 * 	x: [0, 11] denoting months since janurary.
+	 * The mtime only moves as often as the clock ticks, so a directory
+	 * that changed just now could change again without it moving.
+	 * Leave it to a later run to save.
 	 */
-	const int days_past_in_year[] = {
-		31, 59, 90, 120, 151, 181, 212, 243, 273, 304, 334, 365
-	};
-
-	if (!strptime(time_str, fmt, &tm))
-		return -1;
+	clock_gettime(CLOCK_REALTIME, &now);
+	if (now.tv_sec - st.st_mtim.tv_sec < 2)
+		return;
 
-	tyears = tm.tm_year - 70;
-	leaps = (tyears + 2) / 4;
-	/* tm_mon represents num months since janurary (0 - 11) */
-	tdays = tm.tm_mon > 0 ? days_past_in_year[tm.tm_mon - 1] : 0;
-	tdays += tm.tm_mday - 1;
-	tdays = tdays + (tyears * 365) + leaps;
-	utc_hrs = tm.tm_hour + UTC_DIFF;
-	return (tdays * 86400) + (utc_hrs * 3600) + (tm.tm_min * 60) + tm.tm_sec;
+	w.put<uint32_t>(MANIFEST_MAGIC);
+	w.put<uint32_t>(MANIFEST_VERSION);
+	w.put_str(dir);
+	w.put<int64_t>(st.st_mtim.tv_sec);
+	w.put<int64_t>(st.st_mtim.tv_nsec);
+	w.put_varint(logs.size());
+	for (const auto &l : logs) {
+		w.put_str(l.file_name());
+		w.put<int64_t>(l.creation_time());
+	}
+	if (!w.write_to(path))
+		std::cerr << "Failed to write manifest '" << path << "'!\n";
 }
 
-static std::vector<LogFile> compile_logs(const std::string &dir)
+/*
+ * compile_logs - Every log in dir, oldest first
+ *
+ * If given a manifest_path, the list is cached there, see Manifest above.
+ */
+std::vector<LogFile> compile_logs(const std::string &dir, const char *manifest_path)
 {
 	std::vector<LogFile> logs;
-	for (const auto& entry : std::filesystem::directory_iterator(dir)) {
-		time_t log_ctime;
-		std::string file_name{entry.path().u8string()};
-		size_t last_slash;
-
-		if (file_name.find("_1.log") == std::string::npos)
-			continue;
-		last_slash = file_name.rfind("/");
-		log_ctime = str_to_time(
-			file_name.c_str() + last_slash + 1,
-			"ts3server_%Y-%m-%d__%H_%M_%S");
-		if (log_ctime < 0) {
-			std::cerr
-				<< "Failed to parse time for file '"
-				<< file_name
-				<< "'!\n";
+	struct stat st;
+	STAT_TIME(STAT_LIST_TIME);
+
+	if (manifest_path) {
+		if (stat(dir.c_str(), &st) < 0) {
+			std::cerr << "Failed to open log directory '" << dir << "': "
+				<< strerror(errno) << '\n';
 			exit(1);
 		}
-		logs.emplace_back(log_ctime, std::move(file_name));
+		if (load_manifest(manifest_path, dir, st, logs))
+			return logs;
 	}
-	sort(logs.begin(), logs.end());
+
+	logs = list_logs(dir);
+	sort(logs.begin(), logs.end(), [](const LogFile &a, const LogFile &b) {
+		if (a.creation_time() != b.creation_time())
+			return a < b;
+		if (a.log_name() != b.log_name())
+			return a.log_name() < b.log_name();
+		return a.compression() < b.compression();
+	});
+
+	/*
+	 * A log caught half way through being compressed shows up twice.
+	 * Only the original is known to be whole, so that's the one kept.
+	 */
+	logs.erase(std::unique(logs.begin(), logs.end(),
+		[](const LogFile &a, const LogFile &b) {
+			return a.log_name() == b.log_name();
+		}), logs.end());
+
+	if (manifest_path)
+		save_manifest(manifest_path, dir, st, logs);
 	return logs;
 }
 
-static void get_name(const std::string_view &line, std::string &name)
+static std::string_view get_name(std::string_view line)
 {
-	size_t name_start, name_end, npos = std::string::npos;
+	size_t name_start, name_end, npos = std::string_view::npos;
 
 	/*
 	 * Names in the logs are surrounded by ''
@@ -295,12 +328,12 @@ static void get_name(const std::string_view &line, std::string &name)
 	name_end = line.find("'", name_start);
 	if (name_start == npos || name_end == npos)
 		throw std::runtime_error("Failed to parse name!");
-	name = line.substr(name_start, name_end - name_start);
+	return line.substr(name_start, name_end - name_start);
 }
 
-static void get_id(const std::string_view &line, int &id)
+static void get_id(std::string_view line, int &id)
 {
-	size_t id_start, id_end, npos = std::string::npos;
+	size_t id_start, id_end, npos = std::string_view::npos;
 
 	/*
 	 * ID's in the logs are formatted in the logs like: (id:##)
@@ -323,29 +356,33 @@ enum class ClientAction {
 
 /*
  * parse_line - parse the action, name, and id of the client in a line
+ *
+ * name is left pointing into line, so it is only valid for as long as the
+ * line itself is.
  */
-static ClientAction parse_line(const std::string &line, std::string &name, int &id)
+static ClientAction parse_line(std::string_view line, std::string_view &name, int &id)
 {
 	ClientAction a;
 	size_t pos;
 	std::string_view view;
 
 	pos = line.find("client connected");
-	if (pos != std::string::npos) {
+	if (pos != std::string_view::npos) {
 		a = ClientAction::CLIENT_CONNECT;
-		view = std::string_view(line.data() + pos + std::strlen("client connected"));
+		view = line.substr(pos + std::strlen("client connected"));
 	} else {
 		pos = line.find("client disconnected");
-		if (pos == std::string::npos)
+		if (pos == std::string_view::npos)
 			return ClientAction::NO_ACTION;
-		view = std::string_view(line.data() + pos + std::strlen("client disconnected"));
+		view = line.substr(pos + std::strlen("client disconnected"));
 		a = ClientAction::CLIENT_DISCONNECT;
 	}
 
 	try {
-		get_name(view, name);
+		name = get_name(view);
 		get_id(view, id);
 	} catch (std::runtime_error &e) {
+		STAT_ADD(STAT_PARSE_FAILURES, 1);
 		std::cerr << e.what() << '\n';
 		std::cerr << "\tLine that failed: " << line << '\n';
 		a = ClientAction::NO_ACTION;
@@ -354,7 +391,7 @@ static ClientAction parse_line(const std::string &line, std::string &name, int &
 }
 
 /*
- * process_line - Begin processing a single line from the file
+ * read_event - Read the client (dis)connect on a line
  *
  * We need to read the
  * 	- Time and convert it into seconds since the Unix Epoch.
@@ -362,152 +399,622 @@ static ClientAction parse_line(const std::string &line, std::string &name, int &
  * 	- Client id
  * 	- Client action (connection or disconnection)
  *
- * Once the line has been completely read, we can use this information
- * to update the client.
+ * Returns false if the line is anything else. e.time is -1 if the time on
+ * the line could not be parsed.
  */
-static void process_action_on_line(const std::string &line, time_t time_constraint)
+static bool read_event(std::string_view line, LogEvent &e)
 {
 	ClientAction action;
-	time_t time;
-	std::string client_name;
 	int id = 0;
 
-	action = parse_line(line, client_name, id);
+	action = parse_line(line, e.name, id);
 	if (action == ClientAction::NO_ACTION || id == 1)
-		return;
+		return false;
 
 	if (id <= 0) {
 		std::cout << "Failed to parse id! Line: " << line << '\n';
-		return;
+		return false;
 	}
-	time = str_to_time(line.c_str(), "%Y-%m-%d %H:%M:%S");
-	if (time == -1 || time < time_constraint)
-		return;
-
-	switch (action) {
-	case ClientAction::CLIENT_CONNECT:
-		db.log_conn(std::move(client_name), id, time);
-		break;
-	case ClientAction::CLIENT_DISCONNECT:
-		db.log_disconn(id, time);
-		break;
-	case ClientAction::NO_ACTION:
-	default:
-		break;
+	STAT_ADD(STAT_MATCHED, 1);
+	{
+		STAT_TIME(STAT_TIMESTAMP_TIME);
+		e.time = parse_time(line, LINE_TIME_LAYOUT);
 	}
+	e.id = id;
+	e.connect = action == ClientAction::CLIENT_CONNECT;
+	return true;
 }
 
-static void parse_file(std::ifstream &file, time_t time_constraint)
+/*
+ * process_action_on_line - Begin processing a single line from the file
+ *
+ * Once the line has been completely read, we can use this information
+ * to update the client.
+ *
+ * Returns the time of the line if it was a client (dis)connect, even if
+ * it was too old to count, or -1 otherwise.
+ */
+static time_t process_action_on_line(ClientDatabase &db, std::string_view line,
+				     time_t time_constraint)
+{
+	LogEvent e;
+
+	if (!read_event(line, e))
+		return -1;
+	if (e.time == -1 || e.time < time_constraint)
+		return e.time;
+
+	STAT_TIME(STAT_DB_TIME);
+	if (e.connect)
+		db.log_conn(e.name, e.id, e.time);
+	else
+		db.log_disconn(e.id, e.time);
+	return e.time;
+}
+
+static void parse_file(ClientDatabase &db, std::ifstream &file, time_t time_constraint)
 {
 	std::string line;
-	while (std::getline(file, line))
-		process_action_on_line(line, time_constraint);
+	STAT_TIME(STAT_SCAN_TIME);
+
+	while (std::getline(file, line)) {
+		STAT_ADD(STAT_LINES, 1);
+		STAT_ADD(STAT_BYTES, line.size() + 1);
+		process_action_on_line(db, line, time_constraint);
+		db.saw_time(parse_time(line, LINE_TIME_LAYOUT));
+	}
 }
 
-static void parse_files(const std::vector<LogFile> &logs, struct ProgArgs args)
+/*
+ * last_line_time - The time of the last line in buf that has one, or -1
+ *
+ * That is as far as the log got, which is when a connection still open at
+ * the end of it gets closed.
+ */
+static time_t last_line_time(std::string_view buf)
 {
-	for (const auto &l : logs) {
-		std::ifstream infile(l.file_path());
-		parse_file(infile, args.time_constraint);
-		infile.close();
-		db.reset_clients();
+	size_t end = buf.size();
+
+	while (end) {
+		size_t start = buf.rfind('\n', end - 1);
+		time_t t;
+
+		start = start == std::string_view::npos ? 0 : start + 1;
+		t = parse_time(buf.substr(start, end - start), LINE_TIME_LAYOUT);
+		if (t != -1 || !start)
+			return t;
+		end = start - 1;
 	}
+	return -1;
 }
 
-static long get_arg_val(const char *input, char option)
+/*
+ * Candidate scanning
+ *
+ * Nearly every line in a teamspeak log is noise as far as parse_line() is
+ * concerned. Both of the lines we do care about contain "connected":
+ * 	client connected 'name'(id:##) ...
+ * 	client disconnected 'name'(id:##) ...
+ *
+ * So rather than splitting the buffer into lines and searching each one, we
+ * search the whole buffer for "connected" and only confirm a hit once it is
+ * preceded by "client " or "client dis". The lines holding those hits are
+ * the only ones handed to process_action_on_line(), which still runs the
+ * full parse_line() on them so the results match a line by line walk.
+ *
+ * The SIMD variants compare the first ('c') and last ('d') byte of the
+ * needle against a whole register worth of positions at once, which throws
+ * away almost everything before memcmp() ever runs.
+ */
+static constexpr std::string_view CAND_NEEDLE = "connected";
+static constexpr std::string_view CAND_CONN_PREFIX = "client ";
+static constexpr std::string_view CAND_DISCONN_PREFIX = "client dis";
+
+/*
+ * is_candidate - Check if the "connected" found at q is a client (dis)connect
+ *
+ * q must have at least CAND_NEEDLE.size() bytes after it. begin is the
+ * lowest address we may look back to.
+ */
+static inline bool is_candidate(const char *begin, const char *q)
 {
-	char *endptr;
-	long val;
+	size_t back = q - begin;
+
+	if (memcmp(q, CAND_NEEDLE.data(), CAND_NEEDLE.size()))
+		return false;
+	if (back >= CAND_CONN_PREFIX.size() &&
+	    !memcmp(q - CAND_CONN_PREFIX.size(), CAND_CONN_PREFIX.data(),
+		    CAND_CONN_PREFIX.size()))
+		return true;
+	return back >= CAND_DISCONN_PREFIX.size() &&
+		!memcmp(q - CAND_DISCONN_PREFIX.size(), CAND_DISCONN_PREFIX.data(),
+			CAND_DISCONN_PREFIX.size());
+}
 
-	val = strtol(input, &endptr, 10);
-	if (endptr == input) {
-		std::cout << "Error parsing input '" << input
-			<< "' for option '" << option << "'\n";
-		exit(1);
+static const char *find_candidate_scalar(const char *begin, const char *p,
+					 const char *end)
+{
+	const char *last = end - CAND_NEEDLE.size();
+
+	while (p <= last) {
+		p = static_cast<const char *>(memchr(p, CAND_NEEDLE.front(), last - p + 1));
+		if (!p)
+			break;
+		if (is_candidate(begin, p))
+			return p;
+		p++;
 	}
-	if (val <= INT_MIN || val >= INT_MAX) {
-		std::cout << "Input '" << val << "is too large for option '"
-			<< option << "'\n";
-		exit(1);
+	return end;
+}
+
+#ifdef __SSE2__
+static const char *find_candidate_sse2(const char *begin, const char *p,
+				       const char *end)
+{
+	const size_t tail = CAND_NEEDLE.size() - 1;
+	const __m128i first = _mm_set1_epi8(CAND_NEEDLE.front());
+	const __m128i last = _mm_set1_epi8(CAND_NEEDLE.back());
+
+	for (; end - p >= (ptrdiff_t) (16 + tail); p += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i *) p);
+		__m128i b = _mm_loadu_si128((const __m128i *) (p + tail));
+		unsigned int mask = _mm_movemask_epi8(
+			_mm_and_si128(_mm_cmpeq_epi8(a, first),
+				      _mm_cmpeq_epi8(b, last)));
+
+		while (mask) {
+			const char *q = p + __builtin_ctz(mask);
+			if (is_candidate(begin, q))
+				return q;
+			mask &= mask - 1;
+		}
 	}
-	return val;
+	return find_candidate_scalar(begin, p, end);
 }
+#endif
 
-int main(int argc, char *argv[])
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+static const char *find_candidate_avx2(const char *begin, const char *p,
+				       const char *end)
 {
-	std::vector<Client> client_vec;
-	std::vector<LogFile> log_vec;
-	struct ProgArgs args;
-	int opt;
+	const size_t tail = CAND_NEEDLE.size() - 1;
+	const __m256i first = _mm256_set1_epi8(CAND_NEEDLE.front());
+	const __m256i last = _mm256_set1_epi8(CAND_NEEDLE.back());
+
+	for (; end - p >= (ptrdiff_t) (32 + tail); p += 32) {
+		__m256i a = _mm256_loadu_si256((const __m256i *) p);
+		__m256i b = _mm256_loadu_si256((const __m256i *) (p + tail));
+		unsigned int mask = _mm256_movemask_epi8(
+			_mm256_and_si256(_mm256_cmpeq_epi8(a, first),
+					 _mm256_cmpeq_epi8(b, last)));
+
+		while (mask) {
+			const char *q = p + __builtin_ctz(mask);
+			if (is_candidate(begin, q))
+				return q;
+			mask &= mask - 1;
+		}
+	}
+	return find_candidate_scalar(begin, p, end);
+}
+#endif
 
-	while ((opt = getopt(argc, argv, "d:h:st:")) != -1) {
-		struct tm tm;
-		switch (opt) {
-		case 'd':
-			memset(&tm, 0, sizeof(tm));
-			if (!strptime(optarg, "%m-%d-%Y", &tm)) {
-				std::cout
-					<< "Failed to parse -d argument '"
-					<< optarg
-					<< "'\n";
-				exit(1);
-			}
-			args.time_constraint = mktime(&tm);
-			break;
-		case 's':
-			args.time_in_seconds = true;
-			break;
-		case 'h':
-			if (args.tail_count) {
-				std::cout << "Can not use both 'h' and 't' flags\n";
-				exit(1);
-			}
-			args.head_count = get_arg_val(optarg, opt);
-			break;
-		case 't':
-			if (args.head_count) {
-				std::cout << "Can not use both 'h' and 't' flags\n";
-				exit(1);
-			}
-			args.tail_count = get_arg_val(optarg, opt);
-			break;
-		case '?':
-		default:
+using find_candidate_fn = const char *(*)(const char *, const char *, const char *);
+
+/*
+ * pick_find_candidate - Choose the widest scanner the running cpu supports
+ */
+static find_candidate_fn pick_find_candidate(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return find_candidate_avx2;
+#endif
+#ifdef __SSE2__
+	return find_candidate_sse2;
+#else
+	return find_candidate_scalar;
+#endif
+}
+
+/*
+ * for_each_candidate_line - Call fn on every line of buf holding a candidate
+ *
+ * Lines are split the same way std::getline() does, but only the lines
+ * holding a candidate are ever looked at, and every line is just a view
+ * into buf so nothing gets copied or allocated along the way.
+ */
+template <typename F>
+static void for_each_candidate_line(std::string_view buf, F &&fn)
+{
+	static const find_candidate_fn find_candidate = pick_find_candidate();
+	const char *p = buf.data(), *end = buf.data() + buf.size();
+	STAT_TIME(STAT_SCAN_TIME);
+
+	/* Lines are never split up here, so counting them is extra work */
+	STAT_ADD(STAT_LINES, std::count(buf.begin(), buf.end(), '\n'));
+	STAT_ADD(STAT_BYTES, buf.size());
+
+	while (p < end) {
+		const char *hit, *sol, *eol;
+
+		hit = find_candidate(p, p, end);
+		if (hit == end)
 			break;
 
+		/* p is always the start of a line, so never look behind it */
+		sol = static_cast<const char *>(memrchr(p, '\n', hit - p));
+		sol = sol ? sol + 1 : p;
+		eol = static_cast<const char *>(memchr(hit, '\n', end - hit));
+		if (!eol)
+			eol = end;
+
+		fn(std::string_view(sol, eol - sol));
+		p = eol + 1;
+	}
+}
+
+/*
+ * parse_buffer - Parse every client (dis)connect line of an in memory log
+ *
+ * If given an index entry, the times of lines past what it already covers
+ * are recorded in it. buf is assumed to start base bytes into the log.
+ */
+static void parse_buffer(ClientDatabase &db, std::string_view buf, time_t time_constraint,
+			 LogIndexEntry *entry = nullptr, uint64_t base = 0)
+{
+	for_each_candidate_line(buf, [&](std::string_view line) {
+		time_t time = process_action_on_line(db, line, time_constraint);
+		uint64_t offset = base + (line.data() - buf.data());
+
+		if (entry && time >= 0 && offset >= entry->covered)
+			entry->record(offset, time);
+	});
+	db.saw_time(last_line_time(buf));
+	if (entry)
+		entry->covered = std::max<uint64_t>(entry->covered, base + buf.size());
+}
+
+/*
+ * parse_indexed - Parse data, starting at offset, skipping what index says is too old
+ *
+ * data is the whole of the log, or as much of it as is safe to parse.
+ */
+static void parse_indexed(ClientDatabase &db, const LogFile &l, const MappedFile &mf,
+			  std::string_view data, uint64_t offset, time_t time_constraint,
+			  LogIndex *index)
+{
+	LogIndexEntry *entry = nullptr;
+
+	if (index) {
+		entry = &index->entry_for(l.file_name(), mf.inode(), mf.data().size());
+		/* Everything in the log is too old, and nothing new was added */
+		if (time_constraint > entry->max_time && entry->covered >= data.size())
+			return;
+		offset = std::max(offset, entry->start_offset(time_constraint));
+	}
+	if (offset > data.size())
+		offset = data.size();
+	parse_buffer(db, data.substr(offset), time_constraint, entry, offset);
+}
+
+/*
+ * parse_compressed - Run a compressed log through the parser into db, from offset on
+ *
+ * offset counts decompressed bytes. There is no seeking in a compressed
+ * log, so everything before offset still gets decompressed, just never
+ * looked at. Returns the size of the log once decompressed.
+ */
+static uint64_t parse_compressed(ClientDatabase &db, const LogFile &l, uint64_t offset,
+				 time_t time_constraint, LogIndex *index)
+{
+	LogIndexEntry *entry = nullptr;
+	uint64_t base = 0;
+	struct stat st;
+
+	if (index && stat(l.file_path().c_str(), &st) == 0) {
+		/*
+		 * A compressed log is never appended to, so once it has been
+		 * indexed at all it has been indexed all the way through.
+		 */
+		entry = &index->entry_for(l.file_name(), st.st_ino, UINT64_MAX);
+		if (entry->covered && time_constraint > entry->max_time)
+			return entry->covered;
+		offset = std::max(offset, entry->start_offset(time_constraint));
+	}
+
+	STAT_ADD(STAT_FILES, 1);
+	bool ok = stream_log(l, [&](std::string_view chunk) {
+		uint64_t skip = offset > base ? offset - base : 0;
+
+		if (skip < chunk.size())
+			parse_buffer(db, chunk.substr(skip), time_constraint, entry, base + skip);
+		base += chunk.size();
+	});
+
+	/* Don't let a log that was cut short look fully indexed */
+	if (!ok && entry)
+		*entry = LogIndexEntry();
+	return base;
+}
+
+/*
+ * parse_log - Run a single log file through the parser into db
+ *
+ * Logs are always mapped when there is an index to use, since it works in
+ * byte offsets. Compressed logs are streamed through a decompressor either
+ * way.
+ */
+static void parse_log(ClientDatabase &db, const LogFile &l, const struct ProgArgs &args,
+		      LogIndex *index)
+{
+	if (l.compression() != Compression::NONE) {
+		parse_compressed(db, l, 0, args.time_constraint, index);
+	} else if (args.use_mmap || index) {
+		MappedFile mf(l.file_path());
+		parse_indexed(db, l, mf, mf.data(), 0, args.time_constraint, index);
+	} else {
+		std::ifstream infile;
+		{
+			STAT_TIME(STAT_OPEN_TIME);
+			STAT_ADD(STAT_FILES, 1);
+			infile.open(l.file_path());
 		}
+		parse_file(db, infile, args.time_constraint);
+		infile.close();
+	}
+}
+
+/*
+ * read_log_events - Hand every client (dis)connect in a log to add, in order
+ *
+ * Lines whose time can't be parsed never count for anything, so they are
+ * left out. The name of an event is only good until add returns.
+ *
+ * Returns the time of the last line in the log, or -1 if it has none.
+ */
+time_t read_log_events(const LogFile &l, const std::function<void(const LogEvent &)> &add)
+{
+	time_t last = -1;
+	auto read_buffer = [&](std::string_view buf) {
+		for_each_candidate_line(buf, [&](std::string_view line) {
+			LogEvent e;
+
+			if (read_event(line, e) && e.time != -1)
+				add(e);
+		});
+		last = std::max(last, last_line_time(buf));
+	};
+
+	if (l.compression() != Compression::NONE) {
+		STAT_ADD(STAT_FILES, 1);
+		stream_log(l, read_buffer);
+	} else {
+		MappedFile mf(l.file_path());
+		read_buffer(mf.data());
+	}
+	return last;
+}
+
+/*
+ * parse_files_parallel - Parse logs on args.num_jobs threads
+ *
+ * Since every file starts out with reset clients, the accounting of one
+ * file never depends on another. Each file gets parsed into its own
+ * database by whichever worker grabs it, then the per file databases are
+ * merged into db in log order. Merging in order keeps the most recent name
+ * winning, exactly like a serial run.
+ */
+static void parse_files_parallel(ClientDatabase &db, const std::vector<LogFile> &logs,
+				 const struct ProgArgs &args, LogIndex *index)
+{
+	std::vector<ClientDatabase> partial(logs.size());
+	std::vector<std::thread> workers;
+	std::atomic<size_t> next_log{0};
+	unsigned int i, num_workers;
+
+	for (auto &p : partial) {
+		if (db.get_sessions().is_recording())
+			p.record_sessions();
+		if (db.is_closing_at_end())
+			p.close_at_end();
 	}
-	argc -= optind;
-	argv += optind;
+	num_workers = std::min<size_t>(args.num_jobs, logs.size());
 
 	/*
-	 * Ensure that after all flags are parsed, we still have the
-	 * log directory passed in
+	 * Every database a worker fills shares the worker's arena, so a name
+	 * seen in many logs is only copied once per worker, and all of it is
+	 * thrown away at once when the pass is over.
 	 */
-	if (!*argv) {
-		std::cout << "Please input log directory\n";
-		exit(1);
+	std::vector<NameArena> arenas(num_workers);
+	for (i = 0; i < num_workers; i++) {
+		workers.emplace_back([&, i]() {
+			size_t idx;
+
+			while ((idx = next_log.fetch_add(1)) < logs.size()) {
+				partial[idx].share_arena(arenas[i]);
+				parse_log(partial[idx], logs[idx], args, index);
+				partial[idx].reset_clients();
+			}
+		});
+	}
+	for (auto &w : workers)
+		w.join();
+
+	for (const auto &p : partial)
+		db.merge(p);
+	db.reset_clients();
+}
+
+/*
+ * parse_files - Parse every log in logs into db, oldest first
+ */
+void parse_files(ClientDatabase &db, const std::vector<LogFile> &logs,
+		 const struct ProgArgs &args, LogIndex *index)
+{
+	if (args.num_jobs > 1) {
+		parse_files_parallel(db, logs, args, index);
+		return;
+	}
+
+	/* Read the logs ahead of the parser, rather than one by one */
+	if (!args.use_mmap && !index) {
+		read_logs(logs, [&](const LogFile &l, std::string_view data) {
+			if (l.compression() != Compression::NONE)
+				parse_log(db, l, args, index);
+			else
+				parse_buffer(db, data, args.time_constraint);
+			db.reset_clients();
+		});
+		return;
 	}
 
-	log_vec = compile_logs(*argv);
-	parse_files(log_vec, args);
+	for (const auto &l : logs) {
+		parse_log(db, l, args, index);
+		db.reset_clients();
+	}
+}
 
-	for (auto it = db.begin(); it != db.end(); it++)
-		client_vec.push_back(std::move(it->second));
-	/* Want clients in order of greatest to least */
-	sort(client_vec.begin(), client_vec.end(), std::greater<Client>());
 
-	if (args.head_count) {
-		for (auto c = client_vec.begin();
-				c != client_vec.end() && args.head_count--; c++)
-			c->print_client_time(args.time_in_seconds);
-	} else if (args.tail_count) {
-		for (auto c = client_vec.rbegin();
-				c != client_vec.rend() && args.tail_count--; c++)
-			c->print_client_time(args.time_in_seconds);
+/*
+ * parse_log_from - Parse a log starting at byte offset
+ *
+ * If the log is the newest one it may well be half way through having a
+ * line written to it, so parsing stops after the last complete line. A
+ * compressed log is always whole, and its offset counts decompressed bytes.
+ * Returns where the next run should pick up from.
+ */
+CheckpointLog parse_log_from(ClientDatabase &db, const LogFile &l,
+			     uint64_t offset, bool newest, time_t time_constraint,
+			     LogIndex *index)
+{
+	if (l.compression() != Compression::NONE) {
+		struct stat st;
+		uint64_t size;
+
+		if (stat(l.file_path().c_str(), &st) < 0)
+			st.st_ino = 0;
+		size = parse_compressed(db, l, offset, time_constraint, index);
+		return {std::string(l.log_name()), (uint64_t) st.st_ino,
+			std::max(offset, size)};
+	}
+
+	MappedFile mf(l.file_path());
+	std::string_view data = mf.data();
+	CheckpointLog cl{std::string(l.log_name()), mf.inode(), data.size()};
+
+	if (newest) {
+		size_t last_nl = data.rfind('\n');
+
+		data = data.substr(0, last_nl == std::string_view::npos ? 0 : last_nl + 1);
+		cl.offset = std::max<uint64_t>(offset, data.size());
+	}
+	parse_indexed(db, l, mf, data, offset, time_constraint, index);
+	return cl;
+}
+
+/*
+ * update_from_checkpoint - Bring db up to date with logs
+ *
+ * ckpt and db have to describe the same point in time, as left behind by a
+ * previous update (or be empty). Ends up with the same totals as
+ * parse_files() would, without reparsing anything ckpt says was already
+ * seen.
+ */
+void update_from_checkpoint(Checkpoint &ckpt, ClientDatabase &db,
+			    const std::vector<LogFile> &logs, const struct ProgArgs &args,
+			    LogIndex *index)
+{
+	size_t first_new;
+
+	if (!ckpt.matches(logs)) {
+		db.clear();
+		ckpt.logs.clear();
+	}
+	first_new = ckpt.logs.size();
+
+	/* Pick up where we left off in the log that was the newest */
+	if (first_new) {
+		CheckpointLog &last = ckpt.logs.back();
+		last = parse_log_from(db, logs[first_new - 1], last.offset,
+				first_new == logs.size(), args.time_constraint, index);
+	}
+
+	if (first_new < logs.size()) {
+		std::vector<LogFile> done(logs.begin() + first_new, logs.end() - 1);
+
+		/* Whatever was left open in the previous log is gone now */
+		db.reset_clients();
+		parse_files(db, done, args, index);
+		for (const auto &l : done) {
+			struct stat st;
+
+			if (stat(l.file_path().c_str(), &st) < 0)
+				st.st_ino = st.st_size = 0;
+			ckpt.logs.push_back({std::string(l.log_name()),
+					(uint64_t) st.st_ino, (uint64_t) st.st_size});
+		}
+		ckpt.logs.push_back(parse_log_from(db, logs.back(), 0, true,
+					args.time_constraint, index));
+	}
+}
+
+/*
+ * sort_clients - Order every client from the most time connected to the least
+ *
+ * now is handed to Client::time_connected(), so open connections can be
+ * counted too.
+ *
+ * If args is given and only asks for the head or tail, only that many
+ * clients at that end are put in order. format_clients() never looks past
+ * them, so the rest are left wherever partial_sort() happened to put them.
+ */
+std::vector<const Client *> sort_clients(const ClientDatabase &db, time_t now,
+					 const struct ProgArgs *args)
+{
+	std::vector<const Client *> clients;
+	auto more_time = [now](const Client *a, const Client *b) {
+		time_t ta = a->time_connected(now), tb = b->time_connected(now);
+
+		if (ta != tb)
+			return ta > tb;
+		return a->get_id() > b->get_id();
+	};
+
+	STAT_TIME(STAT_SORT_TIME);
+
+	clients.reserve(db.size());
+	for (const Client &c : db)
+		clients.push_back(&c);
+
+	if (args && args->head_count && args->head_count < clients.size()) {
+		std::partial_sort(clients.begin(), clients.begin() + args->head_count,
+				  clients.end(), more_time);
+	} else if (args && args->tail_count && args->tail_count < clients.size()) {
+		/* Sorting the reversed range backwards puts the least time last */
+		std::partial_sort(clients.rbegin(), clients.rbegin() + args->tail_count,
+				  clients.rend(),
+				  [&more_time](const Client *a, const Client *b) {
+					  return more_time(b, a);
+				  });
 	} else {
-		for (auto c = client_vec.rbegin(); c != client_vec.rend(); c++)
-			c->print_client_time(args.time_in_seconds);
+		std::sort(clients.begin(), clients.end(), more_time);
 	}
-	return 0;
+	return clients;
+}
+
+/*
+ * parse_date_arg - Parse a MM-DD-YYYY date, as given to -d
+ */
+bool parse_date_arg(const char *arg, time_t &t)
+{
+	struct tm tm;
+
+	memset(&tm, 0, sizeof(tm));
+	if (!strptime(arg, "%m-%d-%Y", &tm))
+		return false;
+	t = mktime(&tm);
+	return true;
 }
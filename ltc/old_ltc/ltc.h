@@ -0,0 +1,1573 @@
+#ifndef _LTC_H_
+#define _LTC_H_
+#include <bits/stdc++.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <charconv>
+#include <fstream>
+#include <iostream>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+/*
+ * UTC_DIFF: Hours added to every log timestamp. Take it back off to get the
+ * time of day the log itself shows.
+ */
+#define UTC_DIFF 5
+
+/*
+ * Profiling
+ *
+ * Built with LTC_STATS (make STATS=1), ltc keeps counters and phase timers
+ * which --stats prints once it is done. Without it STAT_ADD() and
+ * STAT_TIME() compile away to nothing, arguments and all.
+ *
+ * Each thread counts into its own StatBlock, which is folded into the
+ * totals when the thread exits, so the hot path never touches a shared
+ * cache line. Timers count cycles where there is a cheap cycle counter.
+ */
+#ifdef LTC_STATS
+# if defined(__x86_64__) || defined(__i386__)
+#  include <x86intrin.h>
+# endif
+
+enum StatId {
+	/* Counters */
+	STAT_FILES,
+	STAT_BYTES,
+	STAT_LINES,
+	STAT_MATCHED,		/* Client (dis)connect lines */
+	STAT_PARSE_FAILURES,
+	STAT_CLIENTS,
+	STAT_DUP_CONNECTS,	/* Connecting while already connected */
+	STAT_LOST_DISCONNECTS,	/* Disconnecting without a connect to match */
+
+	/* Timers, in ticks of stat_clock() */
+	STAT_LIST_TIME,		/* compile_logs() */
+	STAT_OPEN_TIME,		/* Opening and mapping or reading in logs */
+	STAT_SCAN_TIME,		/* Going through the lines of logs */
+	STAT_TIMESTAMP_TIME,	/* parse_time() on lines, part of scan */
+	STAT_DB_TIME,		/* Updating the database, part of scan */
+	STAT_SORT_TIME,
+	STAT_OUTPUT_TIME,
+
+	NUM_STATS,
+};
+
+struct StatBlock {
+	~StatBlock(void);
+
+	uint64_t val[NUM_STATS] = {};
+};
+
+extern thread_local StatBlock thread_stats;
+
+static inline uint64_t stat_clock(void)
+{
+# if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+# else
+	return std::chrono::steady_clock::now().time_since_epoch().count();
+# endif
+}
+
+class StatTimer {
+public:
+	StatTimer(StatId s) : id(s), start(stat_clock()) { }
+
+	~StatTimer(void) {
+		thread_stats.val[id] += stat_clock() - start;
+	}
+
+private:
+	StatId id;
+	uint64_t start;
+};
+
+extern void print_stats(std::ostream &out);
+
+# define STAT_ADD(id, n) (thread_stats.val[id] += (n))
+# define STAT_TIME(id) StatTimer stat_timer_##id(id)
+#else
+# define STAT_ADD(id, n) ((void) 0)
+# define STAT_TIME(id) ((void) 0)
+#endif
+
+/*
+ * Compression: How a log is stored on disk, going by its file name
+ */
+enum class Compression {
+	NONE,
+	GZIP,	/* _1.log.gz */
+	ZSTD,	/* _1.log.zst */
+};
+
+/*
+ * Basic representation of a teamspeak log file
+ */
+class LogFile {
+public:
+	LogFile(time_t t, const std::string &n) : time(t), path(n) { }
+
+	LogFile(time_t t, const std::string &&n) : time(t), path(std::move(n)) { }
+
+	bool operator<(const LogFile &b) const {
+		return time < b.time;
+	}
+
+	bool operator>(const LogFile &b) const {
+		return time > b.time;
+	}
+
+	const std::string& file_path(void) const {
+		return path;
+	}
+
+	/* file_name: The path with any leading directories stripped off */
+	std::string_view file_name(void) const {
+		size_t last_slash = path.rfind('/');
+
+		if (last_slash == std::string::npos)
+			return path;
+		return std::string_view(path).substr(last_slash + 1);
+	}
+
+	time_t creation_time(void) const {
+		return time;
+	}
+
+	Compression compression(void) const {
+		std::string_view name = file_name();
+
+		if (name.size() > 3 && name.substr(name.size() - 3) == ".gz")
+			return Compression::GZIP;
+		if (name.size() > 4 && name.substr(name.size() - 4) == ".zst")
+			return Compression::ZSTD;
+		return Compression::NONE;
+	}
+
+	/* log_name: The file name without any compression suffix */
+	std::string_view log_name(void) const {
+		std::string_view name = file_name();
+
+		switch (compression()) {
+		case Compression::GZIP:
+			return name.substr(0, name.size() - 3);
+		case Compression::ZSTD:
+			return name.substr(0, name.size() - 4);
+		case Compression::NONE:
+		default:
+			return name;
+		}
+	}
+
+private:
+	/* time: Time the file was created */
+	time_t time;
+
+	/* path: Path to the file in the directory */
+	std::string path;
+};
+
+/*
+ * BoundedQueue - Hands items from one thread to another
+ *
+ * push() blocks while the queue is full, so a producer can only ever get
+ * so far ahead of its consumer. Once close() is called pop() drains what
+ * is left, then returns false.
+ */
+template <typename T>
+class BoundedQueue {
+public:
+	BoundedQueue(size_t cap) : capacity(cap), closed(false) { }
+
+	void push(T item) {
+		std::unique_lock<std::mutex> guard(lock);
+
+		not_full.wait(guard, [this]() { return items.size() < capacity; });
+		items.push_back(std::move(item));
+		not_empty.notify_one();
+	}
+
+	bool pop(T &item) {
+		std::unique_lock<std::mutex> guard(lock);
+
+		not_empty.wait(guard, [this]() { return !items.empty() || closed; });
+		if (items.empty())
+			return false;
+		item = std::move(items.front());
+		items.pop_front();
+		not_full.notify_one();
+		return true;
+	}
+
+	void close(void) {
+		std::lock_guard<std::mutex> guard(lock);
+
+		closed = true;
+		not_empty.notify_all();
+	}
+
+private:
+	size_t capacity;
+	bool closed;
+	std::deque<T> items;
+	std::mutex lock;
+	std::condition_variable not_full;
+	std::condition_variable not_empty;
+};
+
+/*
+ * Read only memory mapping of a log file, or of one of the files ltc saves
+ * between runs.
+ *
+ * The mapping lives as long as the object, so any std::string_view handed
+ * out by data() must not outlive it.
+ */
+class MappedFile {
+public:
+	/*
+	 * Source - What is being mapped. A SAVED file (checkpoint, index,
+	 * manifest) not being there just means nothing was saved yet, and
+	 * mapping one doesn't count towards the per log stats.
+	 */
+	enum Source { LOG, SAVED };
+
+	MappedFile(const std::string &path, Source src = LOG)
+		: addr(nullptr), len(0), ino(0) {
+		if (src == SAVED) {
+			map(path, true);
+			return;
+		}
+		STAT_TIME(STAT_OPEN_TIME);
+		STAT_ADD(STAT_FILES, 1);
+		map(path, false);
+	}
+
+	MappedFile(const MappedFile &) = delete;
+	MappedFile &operator=(const MappedFile &) = delete;
+
+	~MappedFile(void) {
+		if (addr)
+			munmap(addr, len);
+	}
+
+	std::string_view data(void) const {
+		return std::string_view(addr, len);
+	}
+
+	ino_t inode(void) const {
+		return ino;
+	}
+
+private:
+	/*
+	 * map - Map path, leaving the view empty if anything goes wrong
+	 *
+	 * Failures are printed, unless missing_ok and there is no file.
+	 */
+	void map(const std::string &path, bool missing_ok) {
+		struct stat st;
+		int fd;
+
+		fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd < 0) {
+			if (!missing_ok || errno != ENOENT)
+				std::cerr << "Failed to open '" << path << "': "
+					<< strerror(errno) << '\n';
+			return;
+		}
+		if (fstat(fd, &st) < 0) {
+			std::cerr << "Failed to stat '" << path << "': "
+				<< strerror(errno) << '\n';
+			close(fd);
+			return;
+		}
+		ino = st.st_ino;
+		/* mmap() refuses zero length mappings, an empty view is fine */
+		if (st.st_size > 0) {
+			void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (p == MAP_FAILED) {
+				std::cerr << "Failed to mmap '" << path << "': "
+					<< strerror(errno) << '\n';
+			} else {
+				addr = static_cast<char *>(p);
+				len = st.st_size;
+				madvise(addr, len, MADV_SEQUENTIAL);
+			}
+		}
+		close(fd);
+	}
+
+	/* addr: Start of the mapping, nullptr if nothing is mapped */
+	char *addr;
+
+	/* len: Length of the mapping in bytes */
+	size_t len;
+
+	/* ino: Inode of the file at the time it was mapped */
+	ino_t ino;
+};
+
+/*
+ * Helpers for the binary files ltc keeps around between runs. Values are
+ * stored in host byte order since the files never leave the machine that
+ * wrote them.
+ */
+class ByteWriter {
+public:
+	template <typename T>
+	void put(T val) {
+		static_assert(std::is_trivially_copyable_v<T>);
+		buf.append(reinterpret_cast<const char *>(&val), sizeof(val));
+	}
+
+	void put_str(std::string_view str) {
+		put<uint32_t>(str.size());
+		buf.append(str);
+	}
+
+	/* put_varint: 7 bits at a time, lowest first, for mostly small values */
+	void put_varint(uint64_t val) {
+		while (val >= 0x80) {
+			buf.push_back((char) (val | 0x80));
+			val >>= 7;
+		}
+		buf.push_back((char) val);
+	}
+
+	void put_bytes(std::string_view bytes) {
+		buf.append(bytes);
+	}
+
+	std::string_view data(void) const {
+		return buf;
+	}
+
+	bool write_to(const std::string &path) const;
+
+private:
+	std::string buf;
+};
+
+class ByteReader {
+public:
+	ByteReader(std::string_view data) : buf(data) { }
+
+	template <typename T>
+	T get(void) {
+		T val;
+
+		static_assert(std::is_trivially_copyable_v<T>);
+		if (buf.size() < sizeof(val))
+			throw std::runtime_error("Unexpected end of file!");
+		memcpy(&val, buf.data(), sizeof(val));
+		buf.remove_prefix(sizeof(val));
+		return val;
+	}
+
+	std::string_view get_str(void) {
+		return get_bytes(get<uint32_t>());
+	}
+
+	std::string_view get_bytes(size_t len) {
+		std::string_view bytes;
+
+		if (buf.size() < len)
+			throw std::runtime_error("Unexpected end of file!");
+		bytes = buf.substr(0, len);
+		buf.remove_prefix(len);
+		return bytes;
+	}
+
+	uint64_t get_varint(void) {
+		uint64_t val = 0;
+
+		for (int shift = 0; shift < 64; shift += 7) {
+			if (buf.empty())
+				throw std::runtime_error("Unexpected end of file!");
+
+			unsigned char b = buf.front();
+			buf.remove_prefix(1);
+			val |= (uint64_t) (b & 0x7f) << shift;
+			if (!(b & 0x80))
+				return val;
+		}
+		throw std::runtime_error("Bad varint!");
+	}
+
+private:
+	/* buf: What is left to be read */
+	std::string_view buf;
+};
+
+/*
+ * Representation of a client connecting to the server.
+ *
+ * Only what every (dis)connect line touches lives here. The client's name
+ * is hardly ever needed, so ClientDatabase keeps it off to the side.
+ */
+class Client {
+public:
+	using client_id = unsigned int;
+
+	Client(client_id cid, time_t time) :
+		last_time_connected(time),
+		total_time_connected(0),
+		num_conn(1),
+		total_conns(1),
+		id(cid)
+	{ }
+
+	/*
+	 * Returns whether this is a fresh connection to the server, which is
+	 * the only time the client's name should be updated.
+	 */
+	bool log_conn(time_t t) {
+		if (++num_conn == 1) {
+			last_time_connected = t;
+			total_conns++;
+			return true;
+		}
+		STAT_ADD(STAT_DUP_CONNECTS, 1);
+		return false;
+	}
+
+	/*
+	 * Notes about the if's in this function:
+	 * There seems to be a strange problem with very old teamspeak logs. It
+	 * seems not all (dis)connections have been logged. This causes the parser to
+	 * see things like:
+	 * 	(client) : disconnected
+	 * 	(client) : disconnected
+	 *
+	 * 	instead of...
+	 * 	(client) : connected
+	 * 	(client) : disconnected
+	 *
+	 * This strange behavior causes c->total_time += time_discon - c->last_conn_time
+	 * to accidentally grow very large. The best solution I can work out is just
+	 * ignore these values because we can't reliably tell when they actually
+	 * connected. Thus, on every disconnection set their last connection time to 0
+	 * so if we come across consecutive disconnects the data won't be too crazy.
+	 *
+	 * Returns when the connection that just finished started, or 0 if this
+	 * disconnect did not finish one.
+	 */
+	time_t log_disconn(time_t t) {
+		time_t start = 0;
+
+		if (num_conn) {
+			if (last_time_connected && num_conn == 1) {
+				total_time_connected += t - last_time_connected;
+				start = last_time_connected;
+				last_time_connected = 0;
+			}
+			num_conn--;
+		}
+		if (!start && num_conn == 0)
+			STAT_ADD(STAT_LOST_DISCONNECTS, 1);
+		return start;
+	}
+
+	/*
+	 * close - Finish any open connection at t, as if the client had
+	 * disconnected then
+	 *
+	 * Returns when the connection started, or 0 if there was none.
+	 */
+	time_t close(time_t t) {
+		time_t start = 0;
+
+		if (num_conn && last_time_connected && t > last_time_connected) {
+			total_time_connected += t - last_time_connected;
+			start = last_time_connected;
+		}
+		reset();
+		return start;
+	}
+
+	/* Reset the client's connection fields */
+	void reset(void) {
+		num_conn = 0;
+		last_time_connected = 0;
+	}
+
+	/*
+	 * Fold in the same client's activity from a later log file. Every
+	 * file starts with reset() clients, so the totals simply add up.
+	 */
+	void merge(const Client &later) {
+		total_time_connected += later.total_time_connected;
+		total_conns += later.total_conns;
+	}
+
+	/*
+	 * Ties are broken on the id so the order clients are printed in does
+	 * not depend on how they happened to land in the database.
+	 */
+	bool operator<(const Client &c) const {
+		if (total_time_connected != c.total_time_connected)
+			return total_time_connected < c.total_time_connected;
+		return id < c.id;
+	}
+
+	bool operator>(const Client &c) const {
+		return c < *this;
+	}
+
+	void save(ByteWriter &w) const {
+		w.put<uint32_t>(id);
+		w.put<int64_t>(last_time_connected);
+		w.put<int64_t>(total_time_connected);
+		w.put<uint32_t>(num_conn);
+		w.put<uint64_t>(total_conns);
+	}
+
+	static Client load(ByteReader &r) {
+		client_id id = r.get<uint32_t>();
+		time_t last = r.get<int64_t>();
+		time_t total = r.get<int64_t>();
+		unsigned int conns = r.get<uint32_t>();
+		unsigned long total_conns = r.get<uint64_t>();
+		Client c(id, last);
+
+		c.total_time_connected = total;
+		c.num_conn = conns;
+		c.total_conns = total_conns;
+		return c;
+	}
+
+	client_id get_id(void) const {
+		return id;
+	}
+
+	/*
+	 * time_connected - Total time connected, as of now
+	 *
+	 * If now is given, a connection that is still open counts up until
+	 * then. Otherwise only finished connections count.
+	 */
+	time_t time_connected(time_t now = 0) const {
+		if (now && num_conn && last_time_connected && now > last_time_connected)
+			return total_time_connected + now - last_time_connected;
+		return total_time_connected;
+	}
+
+	/* connections: Number of times the client has connected */
+	unsigned long connections(void) const {
+		return total_conns;
+	}
+
+	/*
+	 * format_duration - Append secs to buf, in seconds or as "Xd Xh Xm Xs"
+	 */
+	static void format_duration(std::string &buf, time_t secs, bool time_in_seconds) {
+		time_t SECS_IN_HOUR = 3600;
+		time_t SECS_IN_DAY = SECS_IN_HOUR * 24;
+
+		if (time_in_seconds) {
+			append_num(buf, secs);
+		} else {
+			unsigned long days, hrs, mins;
+
+			days = secs / SECS_IN_DAY;
+			secs -= days * SECS_IN_DAY;
+			hrs = secs / SECS_IN_HOUR;
+			secs -= hrs * SECS_IN_HOUR;
+			mins = secs / 60;
+			secs -= mins * 60;
+			append_num(buf, days);
+			buf.append("d ");
+			append_num(buf, hrs);
+			buf.append("h ");
+			append_num(buf, mins);
+			buf.append("m ");
+			append_num(buf, secs);
+			buf.push_back('s');
+		}
+	}
+
+	template <typename T>
+	static void append_num(std::string &buf, T val) {
+		char tmp[24];
+		auto res = std::to_chars(tmp, tmp + sizeof(tmp), val);
+
+		buf.append(tmp, res.ptr);
+	}
+
+private:
+	/*
+	 * last_time_connected: Keeps track of when the most recent time the
+	 * client connected to the server.
+	 */
+	time_t last_time_connected;
+
+	/*
+	 * total_time_connected: Keeps track of the total time spent connected
+	 * across multiple disconnects.
+	 */
+	time_t total_time_connected;
+
+	/*
+	 * num_conn: The number of concurrent connections the client currently
+	 * has. e.g, if 'Bob' joins under the name 'Bob' and then rejoins the
+	 * same server 'Bob1' will show up in the logs with the same id.
+	 * This leaves us with:
+	 * 	'Bob' (last_time_connected: 30)
+	 * 	'Bob1' (last_time_connected: 65) <- We don't want that time.
+	 * However, we don't want to lost track of the total time connected
+	 * if one of these two connections disconnect. This member solves this
+	 * issue.
+	 */
+	unsigned int num_conn;
+
+	/*
+	 * total_conns: Number of fresh connections the client made, so
+	 * rejoining under a second name while still connected doesn't count.
+	 */
+	unsigned long total_conns;
+
+	/* id: Unique id the server gave the client */
+	client_id id;
+};
+
+/*
+ * Session - A single connection, from when it started until it finished
+ */
+struct Session {
+	Client::client_id id;
+	time_t start;
+	time_t end;
+};
+
+/*
+ * Every finished connection, in the order they finished. The totals kept by
+ * Client are all most runs want, so sessions are only kept when asked for.
+ *
+ * Saved sessions are delta encoded against the one before: start times move
+ * forward slowly and sessions are short, so nearly everything fits in one or
+ * two bytes.
+ */
+class SessionStore {
+public:
+	SessionStore(void) : recording(false) { }
+
+	void record(void) {
+		recording = true;
+	}
+
+	bool is_recording(void) const {
+		return recording;
+	}
+
+	void add(Client::client_id id, time_t start, time_t end) {
+		if (recording)
+			sessions.push_back({id, start, end});
+	}
+
+	/* Fold in the sessions of a later log */
+	void append(const SessionStore &later) {
+		if (recording)
+			sessions.insert(sessions.end(), later.sessions.begin(), later.sessions.end());
+	}
+
+	void clear(void) {
+		sessions.clear();
+	}
+
+	void save(ByteWriter &w) const {
+		time_t prev = 0;
+
+		w.put<uint8_t>(recording);
+		w.put_varint(sessions.size());
+		for (const auto &s : sessions) {
+			int64_t delta = s.start - prev;
+
+			/* zigzag, so going back a little is small too */
+			w.put_varint(s.id);
+			w.put_varint(((uint64_t) delta << 1) ^ (uint64_t) (delta >> 63));
+			w.put_varint(s.end - s.start);
+			prev = s.start;
+		}
+	}
+
+	/*
+	 * load - Read back saved sessions
+	 *
+	 * Returns whether they were being recorded when saved. Whether they
+	 * are being recorded from here on is left alone.
+	 */
+	bool load(ByteReader &r) {
+		bool was_recording = r.get<uint8_t>();
+		time_t prev = 0;
+		uint64_t n;
+
+		n = r.get_varint();
+		sessions.clear();
+		while (n--) {
+			Session s;
+			uint64_t zz;
+
+			s.id = r.get_varint();
+			zz = r.get_varint();
+			s.start = prev + (int64_t) ((zz >> 1) ^ -(zz & 1));
+			s.end = s.start + r.get_varint();
+			sessions.push_back(s);
+			prev = s.start;
+		}
+		return was_recording;
+	}
+
+	std::vector<Session>::const_iterator begin(void) const {
+		return sessions.begin();
+	}
+
+	std::vector<Session>::const_iterator end(void) const {
+		return sessions.end();
+	}
+
+	size_t size(void) const {
+		return sessions.size();
+	}
+
+private:
+	/* recording: Whether sessions are being kept at all */
+	bool recording;
+
+	std::vector<Session> sessions;
+};
+
+/*
+ * OnlineCurve - How many clients were online, over time
+ *
+ * Kept as the changes to how many were online, in the order they happened.
+ * ClientDatabase fills it in as it goes, along with the sessions and only
+ * when they are recorded, so it never takes a pass of its own. Logs that
+ * overlap in time just add up, the same as they do for peak. Saved the same
+ * way as sessions are.
+ */
+class OnlineCurve {
+public:
+	using Change = std::pair<time_t, int>;
+
+	void add(time_t t, int change) {
+		if (!changes.empty() && changes.back().first == t) {
+			changes.back().second += change;
+			if (!changes.back().second)
+				changes.pop_back();
+		} else if (change) {
+			changes.emplace_back(t, change);
+		}
+	}
+
+	/* Fold in the curve of a later log */
+	void append(const OnlineCurve &later) {
+		changes.insert(changes.end(), later.changes.begin(), later.changes.end());
+	}
+
+	void clear(void) {
+		changes.clear();
+	}
+
+	/* steps - Each time how many were online changed, and what it changed to */
+	std::vector<std::pair<time_t, unsigned int>> steps(void) const {
+		std::vector<Change> sorted = changes;
+		std::vector<std::pair<time_t, unsigned int>> out;
+		int online = 0;
+
+		std::stable_sort(sorted.begin(), sorted.end(),
+			[](const Change &a, const Change &b) { return a.first < b.first; });
+		for (const auto &[t, change] : sorted) {
+			online += change;
+			/* Lines a little out of order can dip below 0 for a moment */
+			if (!out.empty() && out.back().first == t)
+				out.back().second = std::max(online, 0);
+			else
+				out.emplace_back(t, std::max(online, 0));
+		}
+		return out;
+	}
+
+	void save(ByteWriter &w) const {
+		time_t prev = 0;
+
+		w.put_varint(changes.size());
+		for (const auto &[t, change] : changes) {
+			int64_t delta = t - prev;
+
+			w.put_varint(((uint64_t) delta << 1) ^ (uint64_t) (delta >> 63));
+			w.put_varint(((uint64_t) change << 1) ^ (uint64_t) (change >> 31));
+			prev = t;
+		}
+	}
+
+	void load(ByteReader &r) {
+		uint64_t n = r.get_varint();
+		time_t prev = 0;
+
+		changes.clear();
+		while (n--) {
+			uint64_t zz = r.get_varint();
+
+			prev += (int64_t) ((zz >> 1) ^ -(zz & 1));
+			zz = r.get_varint();
+			changes.emplace_back(prev, (int) ((zz >> 1) ^ -(zz & 1)));
+		}
+	}
+
+private:
+	std::vector<Change> changes;
+};
+
+/*
+ * NameArena - Owns one copy of every distinct name handed to intern()
+ *
+ * Names are packed into large blocks which never move, so the views handed
+ * out stay good for as long as the arena is around. Clients reuse the same
+ * few names over and over, so interning keeps memory down as well.
+ */
+class NameArena {
+public:
+	NameArena(void) : next(nullptr), left(0) { }
+
+	NameArena(const NameArena &) = delete;
+	NameArena &operator=(const NameArena &) = delete;
+	NameArena(NameArena &&) = default;
+	NameArena &operator=(NameArena &&) = default;
+
+	std::string_view intern(std::string_view name) {
+		auto res = names.find(name);
+
+		if (res != names.end())
+			return *res;
+
+		char *p = alloc(name.size());
+		memcpy(p, name.data(), name.size());
+		return *names.insert(std::string_view(p, name.size())).first;
+	}
+
+	void clear(void) {
+		names.clear();
+		blocks.clear();
+		left = 0;
+	}
+
+private:
+	static constexpr size_t BLOCK_SIZE = 64 * 1024;
+
+	char *alloc(size_t len) {
+		if (len > left) {
+			size_t size = std::max(len, BLOCK_SIZE);
+
+			blocks.push_back(std::make_unique<char[]>(size));
+			next = blocks.back().get();
+			left = size;
+		}
+		next += len;
+		left -= len;
+		return next - len;
+	}
+
+	std::vector<std::unique_ptr<char[]>> blocks;
+
+	/* next, left: Where the unused part of the newest block starts, and its size */
+	char *next;
+	size_t left;
+
+	std::unordered_set<std::string_view> names;
+};
+
+/*
+ * Database of all client connections
+ *
+ * Teamspeak hands out client ids counting up from 1, so rather than hashing
+ * them the ids index straight into a table of slots. Each client has a slot
+ * in two parallel arrays: the Client, holding what every line touches, and
+ * its name. Keeping the two apart keeps the clients packed tightly.
+ *
+ * Ids too large for the table are still tracked, through a hash map.
+ */
+class ClientDatabase {
+	using client_id = Client::client_id;
+public:
+	void log_conn(std::string_view name, client_id id, time_t t) {
+		uint32_t slot = find_slot(id);
+
+		saw_time(t);
+		if (slot == NO_SLOT) {
+			add_client(id, t, name);
+		} else if (clients[slot].log_conn(t)) {
+			if (names[slot] != name)
+				names[slot] = name_arena().intern(name);
+		} else {
+			return;
+		}
+		set_online(t, online + 1);
+	}
+
+	/*
+	 * Update client node with duration they were connected
+	 */
+	void log_disconn(client_id id, time_t t) {
+		uint32_t slot = find_slot(id);
+
+		saw_time(t);
+		if (slot != NO_SLOT) {
+			time_t start = clients[slot].log_disconn(t);
+
+			if (start) {
+				sessions.add(id, start, t);
+				set_online(t, online - 1);
+			}
+		}
+	}
+
+	/* saw_time - Note the log being parsed got at least as far as t */
+	void saw_time(time_t t) {
+		last_time = std::max(last_time, t);
+	}
+
+	/* last_seen - Latest time seen in the log being parsed, 0 for none */
+	time_t last_seen(void) const {
+		return last_time;
+	}
+
+	/*
+	 * Reset all client's connections. This is important to do because there
+	 * are logs in which not all clients are shown disconnecting before the
+	 * end of the file. This behavior (I believe) is due to the fact that
+	 * the server could have crashed or forced shutdown.
+	 *
+	 * With close_at_end(), those connections are counted up until the
+	 * last time seen in the log instead of being thrown away.
+	 */
+	void reset_clients(void) {
+		if (closing && last_time) {
+			for (auto &c : clients) {
+				time_t start = c.close(last_time);
+
+				if (start)
+					sessions.add(c.get_id(), start, last_time);
+			}
+		} else {
+			for (auto &c : clients)
+				c.reset();
+		}
+		if (online)
+			set_online(last_time, 0);
+		last_time = 0;
+	}
+
+	/*
+	 * Fold in a database built from a single, later, log file. The later
+	 * file always has the more recent name.
+	 */
+	void merge(const ClientDatabase &later) {
+		for (uint32_t i = 0; i < later.clients.size(); i++) {
+			const Client &c = later.clients[i];
+			uint32_t slot = find_slot(c.get_id());
+
+			if (slot == NO_SLOT) {
+				slot = add_client(c.get_id(), 0, later.names[i]);
+				clients[slot] = c;
+			} else {
+				clients[slot].merge(c);
+				if (names[slot] != later.names[i])
+					names[slot] = name_arena().intern(later.names[i]);
+			}
+		}
+		sessions.append(later.sessions);
+		curve.append(later.curve);
+	}
+
+	/* Forget everything, but keep recording sessions if we were */
+	void clear(void) {
+		slots.clear();
+		far_slots.clear();
+		clients.clear();
+		names.clear();
+		own_arena.clear();
+		sessions.clear();
+		curve.clear();
+		online = 0;
+		last_time = 0;
+	}
+
+	/*
+	 * share_arena - Keep names in a rather than an arena of our own
+	 *
+	 * a has to outlive the database. Used to give the short lived
+	 * databases of a single parse pass one arena between them, which dies
+	 * with the pass.
+	 */
+	void share_arena(NameArena &a) {
+		shared_arena = &a;
+	}
+
+	/* Keep every finished session around, see SessionStore */
+	void record_sessions(void) {
+		sessions.record();
+	}
+
+	const SessionStore &get_sessions(void) const {
+		return sessions;
+	}
+
+	const OnlineCurve &get_online_curve(void) const {
+		return curve;
+	}
+
+	/*
+	 * close_at_end - Count connections left open at the end of a log up
+	 * until its last line, rather than dropping them
+	 */
+	void close_at_end(void) {
+		closing = true;
+	}
+
+	bool is_closing_at_end(void) const {
+		return closing;
+	}
+
+	/* name_of - Most recent name c has used on the teamspeak */
+	std::string_view name_of(const Client &c) const {
+		return names[&c - clients.data()];
+	}
+
+	size_t size(void) const {
+		return clients.size();
+	}
+
+	/*
+	 * Save the full state of every client, including any connections
+	 * which are still open.
+	 */
+	void save(ByteWriter &w) const {
+		w.put<uint32_t>(clients.size());
+		for (uint32_t i = 0; i < clients.size(); i++) {
+			clients[i].save(w);
+			w.put_str(names[i]);
+		}
+		sessions.save(w);
+		curve.save(w);
+		w.put<uint8_t>(closing);
+		w.put<uint32_t>(online);
+		w.put<int64_t>(last_time);
+	}
+
+	/*
+	 * Sessions which were never saved can't be made up after the fact, so
+	 * loading a database without them when they are wanted fails. So does
+	 * loading one that was, or wasn't, closing connections at the end of
+	 * logs when we aren't, or are.
+	 */
+	void load(ByteReader &r) {
+		uint32_t n = r.get<uint32_t>();
+
+		clear();
+		while (n--) {
+			Client c = Client::load(r);
+			uint32_t slot = add_client(c.get_id(), 0, r.get_str());
+
+			clients[slot] = c;
+		}
+		if (sessions.load(r))
+			sessions.record();
+		else if (sessions.is_recording())
+			throw std::runtime_error("No sessions were recorded!");
+		curve.load(r);
+		if ((bool) r.get<uint8_t>() != closing)
+			throw std::runtime_error("Saved with a different --close-at-end!");
+		online = r.get<uint32_t>();
+		last_time = r.get<int64_t>();
+	}
+
+	std::vector<Client>::const_iterator begin(void) const {
+		return clients.begin();
+	}
+
+	std::vector<Client>::const_iterator end(void) const {
+		return clients.end();
+	}
+private:
+	static constexpr uint32_t NO_SLOT = UINT32_MAX;
+
+	/* Ids from here on go in far_slots, so a bogus id can't blow up slots */
+	static constexpr client_id MAX_TABLE_ID = 1 << 22;
+
+	uint32_t find_slot(client_id id) const {
+		if (id < slots.size())
+			return slots[id];
+		if (id < MAX_TABLE_ID)
+			return NO_SLOT;
+
+		auto res = far_slots.find(id);
+		return res == far_slots.end() ? NO_SLOT : res->second;
+	}
+
+	uint32_t add_client(client_id id, time_t t, std::string_view name) {
+		uint32_t slot = clients.size();
+
+		if (id < MAX_TABLE_ID) {
+			if (id >= slots.size())
+				slots.resize(std::max<size_t>(id + 1, 2 * slots.size()), NO_SLOT);
+			slots[id] = slot;
+		} else {
+			far_slots.emplace(id, slot);
+		}
+		clients.emplace_back(id, t);
+		names.push_back(name_arena().intern(name));
+		return slot;
+	}
+
+	/* slots: Slot of each client, by id. NO_SLOT if we haven't seen them */
+	std::vector<uint32_t> slots;
+
+	/* far_slots: Slots of clients with ids of MAX_TABLE_ID and up */
+	std::unordered_map<client_id, uint32_t> far_slots;
+
+	/* clients, names: Each client and their name, by slot */
+	std::vector<Client> clients;
+	std::vector<std::string_view> names;
+
+	NameArena &name_arena(void) {
+		return shared_arena ? *shared_arena : own_arena;
+	}
+
+	/*
+	 * own_arena, shared_arena: Where names are kept, shared_arena if it
+	 * is set
+	 */
+	NameArena own_arena;
+	NameArena *shared_arena = nullptr;
+
+	/* set_online - Note that from t on, n clients were connected */
+	void set_online(time_t t, unsigned int n) {
+		if (sessions.is_recording())
+			curve.add(t, (int) n - (int) online);
+		online = n;
+	}
+
+	SessionStore sessions;
+	OnlineCurve curve;
+
+	/* online: Clients with a connection open right now */
+	unsigned int online = 0;
+
+	/* last_time: Latest time seen in the log being parsed, 0 for none */
+	time_t last_time = 0;
+
+	/* closing: Whether close_at_end() was asked for */
+	bool closing = false;
+};
+
+/*
+ * Analysis: What to work out from the sessions, instead of the usual totals
+ */
+enum class Analysis {
+	NONE,
+	HOUR,		/* Time connected by hour of the day */
+	WEEKDAY,	/* Time connected by day of the week */
+	DAY,		/* Time connected on each day */
+	WEEK,		/* Time connected in each week, from Monday */
+	PEAK,		/* Most connections open at once */
+	ONLINE,		/* Most clients online in each hour */
+};
+
+/*
+ * LogEvent - A client (dis)connect, as read from a log
+ *
+ * name points into wherever the line was read from.
+ */
+struct LogEvent {
+	time_t time;
+	Client::client_id id;
+	bool connect;
+	std::string_view name;
+};
+
+/*
+ * OutputFormat: How client times are printed, see output.cpp
+ */
+enum class OutputFormat {
+	TEXT,
+	JSON,
+	CSV,
+	BIN,
+};
+
+struct ProgArgs {
+	time_t time_constraint;
+	unsigned int tail_count;
+	unsigned int head_count;
+	unsigned int num_jobs;
+	const char *checkpoint_path;
+	const char *index_path;
+	const char *manifest_path;
+
+	/*
+	 * live_time: If set, connections that are still open count as being
+	 * connected up until this time.
+	 */
+	time_t live_time;
+	bool time_in_seconds;
+	bool use_mmap;
+	bool follow;
+
+	Analysis analysis;
+
+	/* window_start, window_end: Sessions are cut down to this, 0 if open */
+	time_t window_start;
+	time_t window_end;
+
+	/* client_filter: Only look at this client's sessions, 0 for everyone */
+	Client::client_id client_filter;
+	const char *export_path;
+	OutputFormat format;
+
+	/* events_path: Event store to read instead of logs, see events.cpp */
+	const char *events_path;
+
+	/* close_at_end: See ClientDatabase::close_at_end() */
+	bool close_at_end;
+
+	ProgArgs(void) :
+		time_constraint(0),
+		tail_count(0),
+		head_count(0),
+		num_jobs(1),
+		checkpoint_path(nullptr),
+		index_path(nullptr),
+		manifest_path(nullptr),
+		live_time(0),
+		time_in_seconds(false),
+		use_mmap(false),
+		follow(false),
+		analysis(Analysis::NONE),
+		window_start(0),
+		window_end(0),
+		client_filter(0),
+		export_path(nullptr),
+		format(OutputFormat::TEXT),
+		events_path(nullptr),
+		close_at_end(false)
+	{ }
+};
+
+/*
+ * Checkpointing
+ *
+ * A checkpoint holds the complete state of the database after a run, along
+ * with how far into each log file that run got. The next run loads it back
+ * up and only has to parse what was added since: any brand new log files,
+ * plus whatever was appended to the log which was being written to last
+ * time.
+ *
+ * The state is saved *before* the reset_clients() that would normally
+ * follow the newest log, so connections still open in it carry over.
+ */
+#define CHECKPOINT_MAGIC 0x4b43544c /* "LTCK" */
+#define CHECKPOINT_VERSION 6
+
+struct CheckpointLog {
+	/*
+	 * name: File name of the log, without the directory or any
+	 * compression suffix
+	 */
+	std::string name;
+
+	/* inode: Used to notice a log being replaced under the same name */
+	uint64_t inode;
+
+	/* offset: Number of bytes of the log already parsed */
+	uint64_t offset;
+};
+
+class Checkpoint {
+public:
+	Checkpoint(time_t constraint) : time_constraint(constraint) { }
+
+	/*
+	 * load - Read back a checkpoint, filling in db
+	 *
+	 * Returns false if there is no usable checkpoint at path.
+	 */
+	bool load(const std::string &path, ClientDatabase &db) {
+		MappedFile mf(path, MappedFile::SAVED);
+		ByteReader r(mf.data());
+
+		if (mf.data().empty())
+			return false;
+		try {
+			uint32_t n;
+
+			if (r.get<uint32_t>() != CHECKPOINT_MAGIC ||
+			    r.get<uint32_t>() != CHECKPOINT_VERSION ||
+			    r.get<int64_t>() != time_constraint)
+				return false;
+			n = r.get<uint32_t>();
+			logs.clear();
+			while (n--) {
+				CheckpointLog cl;
+				cl.name = r.get_str();
+				cl.inode = r.get<uint64_t>();
+				cl.offset = r.get<uint64_t>();
+				logs.push_back(std::move(cl));
+			}
+			db.load(r);
+		} catch (std::runtime_error &e) {
+			std::cerr << "Ignoring checkpoint '" << path << "': "
+				<< e.what() << '\n';
+			return false;
+		}
+		return true;
+	}
+
+	bool save(const std::string &path, const ClientDatabase &db) const {
+		ByteWriter w;
+
+		w.put<uint32_t>(CHECKPOINT_MAGIC);
+		w.put<uint32_t>(CHECKPOINT_VERSION);
+		w.put<int64_t>(time_constraint);
+		w.put<uint32_t>(logs.size());
+		for (const auto &cl : logs) {
+			w.put_str(cl.name);
+			w.put<uint64_t>(cl.inode);
+			w.put<uint64_t>(cl.offset);
+		}
+		db.save(w);
+		return w.write_to(path);
+	}
+
+	/*
+	 * matches - Check if the checkpointed logs are still the oldest logs
+	 *
+	 * Every checkpointed log has to still be there, in the same order, as
+	 * the same file and at least as big as it was. Otherwise history has
+	 * been rewritten and the checkpoint can't be trusted.
+	 *
+	 * The exception is a log that has been compressed since, which is a
+	 * new file by then and has no size to compare without decompressing
+	 * it. Going by its name is as good as it gets.
+	 */
+	bool matches(const std::vector<LogFile> &cur) const {
+		if (cur.size() < logs.size())
+			return false;
+		for (size_t i = 0; i < logs.size(); i++) {
+			struct stat st;
+
+			if (cur[i].log_name() != logs[i].name ||
+			    stat(cur[i].file_path().c_str(), &st) < 0)
+				return false;
+			if (cur[i].compression() != Compression::NONE)
+				continue;
+			if ((uint64_t) st.st_ino != logs[i].inode ||
+			    (uint64_t) st.st_size < logs[i].offset)
+				return false;
+		}
+		return true;
+	}
+
+	/* time_constraint: The -d constraint the checkpoint was built with */
+	time_t time_constraint;
+
+	/* logs: Every log parsed so far, oldest first */
+	std::vector<CheckpointLog> logs;
+};
+
+/*
+ * Day index
+ *
+ * A -d constraint drops every line before a point in time, but without an
+ * index those lines still have to be read to find out what time they are.
+ * For every log the index remembers the latest time it has seen so far, and
+ * where in the log that latest time first moved on to a new day. Everything
+ * before one of those offsets is known to be from an earlier day, so a
+ * query for a later time can start reading there, or skip the log entirely
+ * if its latest time is too early.
+ *
+ * Only (dis)connect lines are ever looked at, so only their times count.
+ */
+#define INDEX_MAGIC 0x5844494c /* "LIDX" */
+#define INDEX_VERSION 1
+#define SECS_PER_DAY 86400
+
+struct LogIndexEntry {
+	LogIndexEntry(void) : inode(0), covered(0), max_time(-1) { }
+
+	/*
+	 * start_offset - Where to start reading for lines at or after t
+	 */
+	uint64_t start_offset(time_t t) const {
+		auto it = std::upper_bound(days.begin(), days.end(), t / SECS_PER_DAY,
+			[](time_t day, const std::pair<uint32_t, uint64_t> &d) {
+				return day < d.first;
+			});
+		return it == days.begin() ? 0 : std::prev(it)->second;
+	}
+
+	/* record - Note a line at offset was from time t */
+	void record(uint64_t offset, time_t t) {
+		if (t <= max_time)
+			return;
+		if (max_time < 0 || t / SECS_PER_DAY > max_time / SECS_PER_DAY)
+			days.emplace_back(t / SECS_PER_DAY, offset);
+		max_time = t;
+	}
+
+	/* inode: Used to notice a log being replaced under the same name */
+	uint64_t inode;
+
+	/* covered: Number of bytes at the start of the log indexed so far */
+	uint64_t covered;
+
+	/* max_time: Latest time seen in the covered bytes, -1 if none */
+	time_t max_time;
+
+	/*
+	 * days: (day, offset) where the latest time seen first reached that
+	 * day, in order.
+	 */
+	std::vector<std::pair<uint32_t, uint64_t>> days;
+};
+
+class LogIndex {
+public:
+	/*
+	 * entry_for - Get the entry for a log, as it currently is on disk
+	 *
+	 * The entry is started over if the log is not the file it was
+	 * indexed from anymore. Entries stay put in memory, so different
+	 * threads can work on the entries of different logs.
+	 */
+	LogIndexEntry &entry_for(std::string_view name, uint64_t inode, uint64_t size) {
+		std::lock_guard<std::mutex> guard(lock);
+		LogIndexEntry &e = entries[std::string(name)];
+
+		if (e.inode != inode || e.covered > size) {
+			e = LogIndexEntry();
+			e.inode = inode;
+		}
+		return e;
+	}
+
+	/* retain - Forget every log not in logs */
+	void retain(const std::vector<LogFile> &logs) {
+		std::set<std::string_view> names;
+
+		for (const auto &l : logs)
+			names.insert(l.file_name());
+		for (auto it = entries.begin(); it != entries.end(); ) {
+			if (names.count(it->first))
+				it++;
+			else
+				it = entries.erase(it);
+		}
+	}
+
+	bool load(const std::string &path) {
+		MappedFile mf(path, MappedFile::SAVED);
+		ByteReader r(mf.data());
+
+		if (mf.data().empty())
+			return false;
+		try {
+			uint32_t n;
+
+			if (r.get<uint32_t>() != INDEX_MAGIC ||
+			    r.get<uint32_t>() != INDEX_VERSION)
+				return false;
+			n = r.get<uint32_t>();
+			entries.clear();
+			while (n--) {
+				LogIndexEntry &e = entries[std::string(r.get_str())];
+				uint32_t ndays;
+
+				e.inode = r.get<uint64_t>();
+				e.covered = r.get<uint64_t>();
+				e.max_time = r.get<int64_t>();
+				ndays = r.get<uint32_t>();
+				while (ndays--) {
+					uint32_t day = r.get<uint32_t>();
+					e.days.emplace_back(day, r.get<uint64_t>());
+				}
+			}
+		} catch (std::runtime_error &e) {
+			std::cerr << "Ignoring index '" << path << "': "
+				<< e.what() << '\n';
+			entries.clear();
+			return false;
+		}
+		return true;
+	}
+
+	bool save(const std::string &path) const {
+		ByteWriter w;
+
+		w.put<uint32_t>(INDEX_MAGIC);
+		w.put<uint32_t>(INDEX_VERSION);
+		w.put<uint32_t>(entries.size());
+		for (const auto &[name, e] : entries) {
+			w.put_str(name);
+			w.put<uint64_t>(e.inode);
+			w.put<uint64_t>(e.covered);
+			w.put<int64_t>(e.max_time);
+			w.put<uint32_t>(e.days.size());
+			for (const auto &[day, offset] : e.days) {
+				w.put<uint32_t>(day);
+				w.put<uint64_t>(offset);
+			}
+		}
+		return w.write_to(path);
+	}
+
+private:
+	/* entries: Index of each log, by file name */
+	std::map<std::string, LogIndexEntry, std::less<>> entries;
+
+	std::mutex lock;
+};
+
+extern std::vector<LogFile> compile_logs(const std::string &dir,
+					 const char *manifest_path = nullptr);
+extern bool stream_log(const LogFile &l,
+		       const std::function<void(std::string_view)> &consume);
+extern void read_logs(const std::vector<LogFile> &logs,
+		      const std::function<void(const LogFile &, std::string_view)> &consume);
+extern time_t read_log_events(const LogFile &l,
+			    const std::function<void(const LogEvent &)> &add);
+extern bool parse_date_arg(const char *arg, time_t &t);
+extern void parse_files(ClientDatabase &db, const std::vector<LogFile> &logs,
+			const struct ProgArgs &args, LogIndex *index = nullptr);
+extern void update_from_checkpoint(Checkpoint &ckpt, ClientDatabase &db,
+				   const std::vector<LogFile> &logs,
+				   const struct ProgArgs &args, LogIndex *index = nullptr);
+extern time_t log_time_now(void);
+extern CheckpointLog parse_log_from(ClientDatabase &db, const LogFile &l,
+				    uint64_t offset, bool newest, time_t time_constraint,
+				    LogIndex *index = nullptr);
+extern std::vector<const Client *> sort_clients(const ClientDatabase &db, time_t now = 0,
+						const struct ProgArgs *args = nullptr);
+extern bool parse_format_arg(const char *arg, OutputFormat &f);
+extern void format_clients(std::string &buf, const ClientDatabase &db,
+			   const std::vector<const Client *> &clients,
+			   const struct ProgArgs &args);
+extern bool write_all(int fd, std::string_view buf);
+extern bool parse_analysis_arg(const char *arg, Analysis &a);
+extern void print_analysis(std::ostream &out, const ClientDatabase &db,
+			   const struct ProgArgs &args);
+extern bool export_sessions(const std::string &path, const ClientDatabase &db);
+extern bool import_events(const std::string &path, const std::vector<LogFile> &logs);
+extern bool parse_event_store(ClientDatabase &db, const std::string &path,
+			      time_t time_constraint);
+extern int run_server(const char *sock_path, const char *log_dir,
+		      const struct ProgArgs &args);
+
+#endif
@@ -0,0 +1,269 @@
+#include <getopt.h>
+#include "ltc.h"
+
+/*
+ * parse_files_incremental - Parse logs picking up from a checkpoint file
+ */
+static void parse_files_incremental(ClientDatabase &db, const std::vector<LogFile> &logs,
+				    const struct ProgArgs &args, LogIndex *index)
+{
+	Checkpoint ckpt(args.time_constraint);
+
+	if (!ckpt.load(args.checkpoint_path, db)) {
+		db.clear();
+		ckpt.logs.clear();
+	}
+	update_from_checkpoint(ckpt, db, logs, args, index);
+	if (!ckpt.save(args.checkpoint_path, db))
+		std::cerr << "Failed to write checkpoint '"
+			<< args.checkpoint_path << "'!\n";
+	/* The next run picks up the newest log where it left off, but this one ends here */
+	db.reset_clients();
+}
+
+static long get_arg_val(const char *input, char option)
+{
+	char *endptr;
+	long val;
+
+	val = strtol(input, &endptr, 10);
+	if (endptr == input) {
+		std::cout << "Error parsing input '" << input
+			<< "' for option '" << option << "'\n";
+		exit(1);
+	}
+	if (val <= INT_MIN || val >= INT_MAX) {
+		std::cout << "Input '" << val << "is too large for option '"
+			<< option << "'\n";
+		exit(1);
+	}
+	return val;
+}
+
+int main(int argc, char *argv[])
+{
+	static const struct option long_opts[] = {
+		{ "serve", required_argument, nullptr, 'S' },
+		{ "follow", no_argument, nullptr, 'f' },
+		{ "analyze", required_argument, nullptr, 'A' },
+		{ "client", required_argument, nullptr, 'C' },
+		{ "until", required_argument, nullptr, 'u' },
+		{ "export-sessions", required_argument, nullptr, 'e' },
+		{ "output", required_argument, nullptr, 'o' },
+		{ "stats", no_argument, nullptr, 'P' },
+		{ "events", required_argument, nullptr, 'E' },
+		{ "manifest", required_argument, nullptr, 'M' },
+		{ "close-at-end", no_argument, nullptr, 'X' },
+		{ nullptr, 0, nullptr, 0 },
+	};
+	std::vector<LogFile> log_vec;
+	ClientDatabase db;
+	LogIndex index;
+	struct ProgArgs args;
+	const char *sock_path = nullptr;
+	bool show_stats = false;
+	int opt;
+
+	/* ltc import <event store> <log directory> */
+	if (argc > 1 && !strcmp(argv[1], "import")) {
+		if (argc != 4) {
+			std::cout << "Usage: ltc import <event store> <log directory>\n";
+			exit(1);
+		}
+		if (!import_events(argv[2], compile_logs(argv[3]))) {
+			std::cerr << "Failed to write event store '" << argv[2] << "'!\n";
+			exit(1);
+		}
+		return 0;
+	}
+
+	while ((opt = getopt_long(argc, argv, "A:C:c:d:E:e:fh:i:j:M:mo:st:u:", long_opts, nullptr)) != -1) {
+		switch (opt) {
+		case 'A':
+			if (!parse_analysis_arg(optarg, args.analysis)) {
+				std::cout << "Unknown analysis '" << optarg
+					<< "', expected hour, weekday, day, week, peak or online\n";
+				exit(1);
+			}
+			break;
+		case 'C':
+			if (get_arg_val(optarg, opt) < 2) {
+				std::cout << "Bad client id for option 'C'\n";
+				exit(1);
+			}
+			args.client_filter = get_arg_val(optarg, opt);
+			break;
+		case 'E':
+			args.events_path = optarg;
+			break;
+		case 'e':
+			args.export_path = optarg;
+			break;
+		case 'u':
+			if (!parse_date_arg(optarg, args.window_end)) {
+				std::cout
+					<< "Failed to parse -u argument '"
+					<< optarg
+					<< "'\n";
+				exit(1);
+			}
+			break;
+		case 'c':
+			args.checkpoint_path = optarg;
+			break;
+		case 'd':
+			if (!parse_date_arg(optarg, args.time_constraint)) {
+				std::cout
+					<< "Failed to parse -d argument '"
+					<< optarg
+					<< "'\n";
+				exit(1);
+			}
+			break;
+		case 'j':
+			if (get_arg_val(optarg, opt) < 1) {
+				std::cout << "Need at least 1 job for option 'j'\n";
+				exit(1);
+			}
+			args.num_jobs = get_arg_val(optarg, opt);
+			break;
+		case 'f':
+			args.follow = true;
+			break;
+		case 'i':
+			args.index_path = optarg;
+			break;
+		case 'M':
+			args.manifest_path = optarg;
+			break;
+		case 'm':
+			args.use_mmap = true;
+			break;
+		case 'o':
+			if (!parse_format_arg(optarg, args.format)) {
+				std::cout << "Unknown output format '" << optarg
+					<< "', expected text, json, csv or bin\n";
+				exit(1);
+			}
+			break;
+		case 'P':
+#ifndef LTC_STATS
+			std::cout << "ltc was built without stats, rebuild with 'make STATS=1'\n";
+			exit(1);
+#endif
+			show_stats = true;
+			break;
+		case 'S':
+			sock_path = optarg;
+			break;
+		case 'X':
+			args.close_at_end = true;
+			break;
+		case 's':
+			args.time_in_seconds = true;
+			break;
+		case 'h':
+			if (args.tail_count) {
+				std::cout << "Can not use both 'h' and 't' flags\n";
+				exit(1);
+			}
+			args.head_count = get_arg_val(optarg, opt);
+			break;
+		case 't':
+			if (args.head_count) {
+				std::cout << "Can not use both 'h' and 't' flags\n";
+				exit(1);
+			}
+			args.tail_count = get_arg_val(optarg, opt);
+			break;
+		case '?':
+		default:
+			break;
+
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	/*
+	 * Ensure that after all flags are parsed, we still have the
+	 * log directory passed in
+	 */
+	if (!*argv && !args.events_path) {
+		std::cout << "Please input log directory\n";
+		exit(1);
+	}
+	if (args.events_path && (sock_path || args.checkpoint_path || args.index_path)) {
+		std::cout << "Can not use an event store with --serve, 'c' or 'i'\n";
+		exit(1);
+	}
+
+	if (sock_path)
+		return run_server(sock_path, *argv, args);
+	if (args.follow) {
+		std::cout << "Following the logs only works with --serve\n";
+		exit(1);
+	}
+
+	/*
+	 * An analysis looks at the sessions from the whole history, with -d
+	 * only picking where its window starts. That way a session which was
+	 * already open at the start of the window still counts for the part
+	 * that falls inside it.
+	 */
+	if (args.analysis != Analysis::NONE) {
+		args.window_start = args.time_constraint;
+		args.time_constraint = 0;
+	}
+	if (args.analysis != Analysis::NONE || args.export_path)
+		db.record_sessions();
+	if (args.close_at_end)
+		db.close_at_end();
+
+	if (args.events_path) {
+		if (!parse_event_store(db, args.events_path, args.time_constraint))
+			exit(1);
+	} else {
+		log_vec = compile_logs(*argv, args.manifest_path);
+		if (args.index_path)
+			index.load(args.index_path);
+		if (args.checkpoint_path)
+			parse_files_incremental(db, log_vec, args,
+					args.index_path ? &index : nullptr);
+		else
+			parse_files(db, log_vec, args, args.index_path ? &index : nullptr);
+	}
+	if (args.index_path) {
+		index.retain(log_vec);
+		if (!index.save(args.index_path))
+			std::cerr << "Failed to write index '"
+				<< args.index_path << "'!\n";
+	}
+	if (args.export_path && !export_sessions(args.export_path, db)) {
+		std::cerr << "Failed to write sessions '"
+			<< args.export_path << "'!\n";
+		exit(1);
+	}
+	if (args.analysis != Analysis::NONE) {
+		print_analysis(std::cout, db, args);
+	} else {
+		std::vector<const Client *> sorted = sort_clients(db, 0, &args);
+		std::string out;
+		STAT_TIME(STAT_OUTPUT_TIME);
+
+		format_clients(out, db, sorted, args);
+		/* Anything complained about while parsing goes first */
+		std::cout.flush();
+		if (!write_all(STDOUT_FILENO, out))
+			exit(1);
+	}
+#ifdef LTC_STATS
+	if (show_stats) {
+		STAT_ADD(STAT_CLIENTS, db.size());
+		print_stats(std::cerr);
+	}
+#else
+	(void) show_stats;
+#endif
+	return 0;
+}
@@ -0,0 +1,258 @@
+/*
+ * Output encoders
+ *
+ * Client times can be printed as:
+ * 	text	- "<time>\t<name>" a line, what ltc has always printed
+ * 	json	- [{"id":..,"name":"..","time":..,"connections":..},...]
+ * 	csv	- An "id,name,time,connections" header, then a row per client
+ * 	bin	- A length prefixed record per client, see append_bin()
+ * Only text pays attention to -s, the others always give seconds.
+ *
+ * Everything is encoded into one buffer, sized up front, which the caller
+ * hands to a single write() rather than going through iostreams one client
+ * at a time.
+ */
+#include "ltc.h"
+
+/*
+ * pick_clients - The clients args asks for, in the order they are printed
+ */
+static std::vector<const Client *> pick_clients(const std::vector<const Client *> &clients,
+						const struct ProgArgs &args)
+{
+	if (args.head_count) {
+		size_t n = std::min<size_t>(args.head_count, clients.size());
+
+		return std::vector<const Client *>(clients.begin(), clients.begin() + n);
+	}
+	if (args.tail_count) {
+		size_t n = std::min<size_t>(args.tail_count, clients.size());
+
+		return std::vector<const Client *>(clients.rbegin(), clients.rbegin() + n);
+	}
+	return std::vector<const Client *>(clients.rbegin(), clients.rend());
+}
+
+/*
+ * max_encoded_len - Most bytes a client can take up in format f
+ *
+ * Numbers take at most 20 digits, and names grow the most in json, where a
+ * control character turns into a 6 byte escape.
+ */
+static size_t max_encoded_len(std::string_view name, OutputFormat f)
+{
+	switch (f) {
+	case OutputFormat::JSON:
+		return 6 * name.size() + 112;
+	case OutputFormat::CSV:
+		return 2 * name.size() + 72;
+	case OutputFormat::BIN:
+		return name.size() + 24;
+	case OutputFormat::TEXT:
+	default:
+		return name.size() + 96;
+	}
+}
+
+static void append_json_str(std::string &buf, std::string_view str)
+{
+	static const char hex[] = "0123456789abcdef";
+
+	buf.push_back('"');
+	for (unsigned char ch : str) {
+		if (ch == '"' || ch == '\\') {
+			buf.push_back('\\');
+			buf.push_back(ch);
+		} else if (ch < 0x20) {
+			buf.append("\\u00");
+			buf.push_back(hex[ch >> 4]);
+			buf.push_back(hex[ch & 0xf]);
+		} else {
+			buf.push_back(ch);
+		}
+	}
+	buf.push_back('"');
+}
+
+/* Fields holding a comma, quote or line break are quoted, per RFC 4180 */
+static void append_csv_str(std::string &buf, std::string_view str)
+{
+	if (str.find_first_of(",\"\r\n") == std::string_view::npos) {
+		buf.append(str);
+		return;
+	}
+	buf.push_back('"');
+	for (char ch : str) {
+		if (ch == '"')
+			buf.push_back('"');
+		buf.push_back(ch);
+	}
+	buf.push_back('"');
+}
+
+template <typename T>
+static void append_le(std::string &buf, T val)
+{
+	for (size_t i = 0; i < sizeof(val); i++)
+		buf.push_back((char) ((uint64_t) val >> (8 * i)));
+}
+
+/*
+ * append_bin - Append a client as a binary record
+ *
+ * Every field is little endian:
+ * 	u32 length	- Bytes in the rest of the record
+ * 	u32 id
+ * 	u64 time	- In seconds
+ * 	u64 connections
+ * 	name		- Whatever is left of the record
+ */
+static void append_bin(std::string &buf, const Client &c, std::string_view name,
+		       time_t secs)
+{
+	append_le<uint32_t>(buf, 20 + name.size());
+	append_le<uint32_t>(buf, c.get_id());
+	append_le<uint64_t>(buf, secs);
+	append_le<uint64_t>(buf, c.connections());
+	buf.append(name);
+}
+
+/*
+ * parse_format_arg - Parse the name of an output format, as given to -o
+ */
+bool parse_format_arg(const char *arg, OutputFormat &f)
+{
+	static const std::pair<const char *, OutputFormat> names[] = {
+		{ "text", OutputFormat::TEXT },
+		{ "json", OutputFormat::JSON },
+		{ "csv", OutputFormat::CSV },
+		{ "bin", OutputFormat::BIN },
+	};
+
+	for (const auto &[name, format] : names) {
+		if (!strcmp(arg, name)) {
+			f = format;
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * format_clients - Encode clients (sorted by sort_clients()) as asked for in args
+ */
+void format_clients(std::string &buf, const ClientDatabase &db,
+		    const std::vector<const Client *> &clients,
+		    const struct ProgArgs &args)
+{
+	std::vector<const Client *> shown = pick_clients(clients, args);
+	size_t len = buf.size() + 64;
+	bool first = true;
+
+	for (const Client *c : shown)
+		len += max_encoded_len(db.name_of(*c), args.format);
+	buf.reserve(len);
+
+	if (args.format == OutputFormat::JSON)
+		buf.push_back('[');
+	else if (args.format == OutputFormat::CSV)
+		buf.append("id,name,time,connections\n");
+
+	for (const Client *c : shown) {
+		time_t secs = c->time_connected(args.live_time);
+		std::string_view name = db.name_of(*c);
+
+		switch (args.format) {
+		case OutputFormat::JSON:
+			if (!first)
+				buf.push_back(',');
+			buf.append("{\"id\":");
+			Client::append_num(buf, c->get_id());
+			buf.append(",\"name\":");
+			append_json_str(buf, name);
+			buf.append(",\"time\":");
+			Client::append_num(buf, secs);
+			buf.append(",\"connections\":");
+			Client::append_num(buf, c->connections());
+			buf.push_back('}');
+			break;
+		case OutputFormat::CSV:
+			Client::append_num(buf, c->get_id());
+			buf.push_back(',');
+			append_csv_str(buf, name);
+			buf.push_back(',');
+			Client::append_num(buf, secs);
+			buf.push_back(',');
+			Client::append_num(buf, c->connections());
+			buf.push_back('\n');
+			break;
+		case OutputFormat::BIN:
+			append_bin(buf, *c, name, secs);
+			break;
+		case OutputFormat::TEXT:
+		default:
+			Client::format_duration(buf, secs, args.time_in_seconds);
+			buf.push_back('\t');
+			buf.append(name);
+			buf.push_back('\n');
+			break;
+		}
+		first = false;
+	}
+
+	if (args.format == OutputFormat::JSON)
+		buf.append("]\n");
+}
+
+/*
+ * write_all - Write all of buf to fd
+ *
+ * Returns false if some of it could not be written.
+ */
+bool write_all(int fd, std::string_view buf)
+{
+	const char *p = buf.data();
+	size_t left = buf.size();
+
+	while (left) {
+		ssize_t nw = write(fd, p, left);
+
+		if (nw < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		p += nw;
+		left -= nw;
+	}
+	return true;
+}
+
+/*
+ * ByteWriter::write_to - Write everything out to path
+ *
+ * The data goes to a temporary file first which is then synced and renamed
+ * over path, so readers never see a half written file. The temporary file
+ * gets a name of its own, as the webserver and the bot can both be saving
+ * the same index at once.
+ */
+bool ByteWriter::write_to(const std::string &path) const
+{
+	std::string tmp_path = path + ".XXXXXX";
+	int fd;
+
+	fd = mkostemp(tmp_path.data(), O_CLOEXEC);
+	if (fd < 0)
+		return false;
+	/* mkstemp() makes it 0600, saved files are as readable as the logs */
+	if (fchmod(fd, 0644) < 0 || !write_all(fd, buf) || fsync(fd) < 0) {
+		close(fd);
+		unlink(tmp_path.c_str());
+		return false;
+	}
+	if (close(fd) < 0 || rename(tmp_path.c_str(), path.c_str()) < 0) {
+		unlink(tmp_path.c_str());
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,439 @@
+/*
+ * Log read pipeline
+ *
+ * Teamspeak starts a new log every time the server restarts, so a log
+ * directory is mostly lots of small files. Reading them one at a time means
+ * waiting on an open() and a read() per file, which on a cold cache is where
+ * all of the time goes. Instead read_logs() keeps up to READ_AHEAD logs
+ * being read at once on a thread of its own, and hands each one over whole,
+ * in log order, through a BoundedQueue.
+ *
+ * Reads go through io_uring when the kernel has it, using the system calls
+ * directly rather than pulling in liburing. Otherwise a pool of threads
+ * doing plain blocking reads stands in for it.
+ */
+#include "ltc.h"
+/* After ltc.h, since linux/fs.h defines a BLOCK_SIZE of its own */
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+
+/* Logs being read at once, and read logs that can wait for the parser */
+#define READ_AHEAD 32
+#define READ_QUEUE 4
+
+/* Threads reading when there is no io_uring */
+#define READ_THREADS 8
+
+struct PendingRead {
+	PendingRead(const LogFile &l) : log(l), fd(-1), got(0), finished(false) { }
+
+	const LogFile &log;
+	int fd;
+	std::string data;
+
+	/* got: Bytes of data read in so far */
+	size_t got;
+	bool finished;
+};
+
+/*
+ * read_failed - Give up on reading p, leaving it empty
+ */
+static void read_failed(PendingRead &p, const char *what, int err)
+{
+	std::cerr << "Failed to " << what << " '" << p.log.file_path() << "': "
+		<< strerror(err) << '\n';
+	p.data.clear();
+}
+
+/*
+ * size_buffer - Make room in p for the whole of the log it just opened
+ *
+ * Returns false if there is nothing to read.
+ */
+static bool size_buffer(PendingRead &p)
+{
+	struct stat st;
+
+	if (fstat(p.fd, &st) < 0) {
+		read_failed(p, "stat", errno);
+		return false;
+	}
+	p.data.resize(st.st_size);
+	return st.st_size > 0;
+}
+
+/*
+ * ReadBackend - Something that can have many logs being read at once
+ */
+class ReadBackend {
+public:
+	virtual ~ReadBackend(void) { }
+
+	/* start - Start reading the log of p, which is the idx'th log */
+	virtual void start(size_t idx, PendingRead &p) = 0;
+
+	/*
+	 * wait - Wait for at least one started log to be read in full
+	 *
+	 * The idx of every log that was is added to done. Its file has been
+	 * closed and its data cut down to what was actually read.
+	 */
+	virtual void wait(std::vector<size_t> &done) = 0;
+};
+
+/*
+ * UringReader - Reads logs through an io_uring
+ *
+ * Each log is an IORING_OP_OPENAT, followed by as many IORING_OP_READs as
+ * it takes. The fstat() and close() in between are left as plain system
+ * calls, they never wait on the disk.
+ */
+class UringReader : public ReadBackend {
+public:
+	UringReader(unsigned entries) : ring_fd(-1), sq_ptr(MAP_FAILED),
+		cq_ptr(MAP_FAILED), sqes(static_cast<io_uring_sqe *>(MAP_FAILED)),
+		to_submit(0)
+	{
+		struct io_uring_params p = {};
+
+		ring_fd = syscall(__NR_io_uring_setup, entries, &p);
+		if (ring_fd < 0)
+			return;
+
+		sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+		cq_len = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+		if (p.features & IORING_FEAT_SINGLE_MMAP)
+			sq_len = cq_len = std::max(sq_len, cq_len);
+		sq_ptr = mmap(nullptr, sq_len, PROT_READ | PROT_WRITE,
+			      MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+		if (sq_ptr == MAP_FAILED)
+			return;
+		if (p.features & IORING_FEAT_SINGLE_MMAP)
+			cq_ptr = sq_ptr;
+		else
+			cq_ptr = mmap(nullptr, cq_len, PROT_READ | PROT_WRITE,
+				      MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+		if (cq_ptr == MAP_FAILED)
+			return;
+		sqes_len = p.sq_entries * sizeof(io_uring_sqe);
+		sqes = static_cast<io_uring_sqe *>(mmap(nullptr, sqes_len,
+				PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+				ring_fd, IORING_OFF_SQES));
+		if (sqes == MAP_FAILED)
+			return;
+
+		char *sq = static_cast<char *>(sq_ptr), *cq = static_cast<char *>(cq_ptr);
+		sq_tail = reinterpret_cast<unsigned *>(sq + p.sq_off.tail);
+		sq_mask = *reinterpret_cast<unsigned *>(sq + p.sq_off.ring_mask);
+		sq_array = reinterpret_cast<unsigned *>(sq + p.sq_off.array);
+		cq_head = reinterpret_cast<unsigned *>(cq + p.cq_off.head);
+		cq_tail = reinterpret_cast<unsigned *>(cq + p.cq_off.tail);
+		cq_mask = *reinterpret_cast<unsigned *>(cq + p.cq_off.ring_mask);
+		cqes = reinterpret_cast<io_uring_cqe *>(cq + p.cq_off.cqes);
+		sqe_tail = *sq_tail;
+	}
+
+	~UringReader(void) {
+		if (sqes != MAP_FAILED)
+			munmap(sqes, sqes_len);
+		if (cq_ptr != MAP_FAILED && cq_ptr != sq_ptr)
+			munmap(cq_ptr, cq_len);
+		if (sq_ptr != MAP_FAILED)
+			munmap(sq_ptr, sq_len);
+		if (ring_fd >= 0)
+			close(ring_fd);
+	}
+
+	/*
+	 * is_ready - Check the ring was set up, and the kernel knows every
+	 * operation we need. Both only showed up in 5.6.
+	 */
+	bool is_ready(void) const {
+		const size_t max_ops = 256;
+		std::vector<char> buf(sizeof(io_uring_probe) + max_ops * sizeof(io_uring_probe_op));
+		auto *probe = reinterpret_cast<io_uring_probe *>(buf.data());
+
+		if (sqes == MAP_FAILED)
+			return false;
+		if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE,
+			    probe, max_ops) < 0)
+			return false;
+		for (unsigned op : { IORING_OP_OPENAT, IORING_OP_READ }) {
+			if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED))
+				return false;
+		}
+		return true;
+	}
+
+	void start(size_t idx, PendingRead &p) override {
+		io_uring_sqe *sqe = get_sqe();
+
+		sqe->opcode = IORING_OP_OPENAT;
+		sqe->fd = AT_FDCWD;
+		sqe->addr = reinterpret_cast<uintptr_t>(p.log.file_path().c_str());
+		sqe->open_flags = O_RDONLY | O_CLOEXEC;
+		sqe->user_data = idx;
+		pending[idx] = &p;
+	}
+
+	void wait(std::vector<size_t> &done) override {
+		while (done.empty()) {
+			unsigned head = *cq_head;
+
+			submit(1);
+			for (; head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE); head++) {
+				const io_uring_cqe &cqe = cqes[head & cq_mask];
+
+				if (completed(cqe.user_data, *pending[cqe.user_data], cqe.res)) {
+					done.push_back(cqe.user_data);
+					pending.erase(cqe.user_data);
+				}
+			}
+			__atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+		}
+		/* Don't leave the next reads sitting until the next wait() */
+		if (to_submit)
+			submit(0);
+	}
+
+private:
+	/*
+	 * get_sqe - Get the next free submission, zeroed
+	 *
+	 * Every pending log has at most one submission at a time, so as long
+	 * as there are no more of them than the ring has entries, there is
+	 * always one free.
+	 */
+	io_uring_sqe *get_sqe(void) {
+		unsigned idx = sqe_tail++ & sq_mask;
+
+		sq_array[idx] = idx;
+		memset(&sqes[idx], 0, sizeof(sqes[idx]));
+		to_submit++;
+		return &sqes[idx];
+	}
+
+	void queue_read(size_t idx, PendingRead &p) {
+		io_uring_sqe *sqe = get_sqe();
+
+		sqe->opcode = IORING_OP_READ;
+		sqe->fd = p.fd;
+		sqe->addr = reinterpret_cast<uintptr_t>(p.data.data() + p.got);
+		sqe->len = std::min<size_t>(p.data.size() - p.got, INT_MAX);
+		sqe->off = p.got;
+		sqe->user_data = idx;
+	}
+
+	/*
+	 * completed - Move p along now that its last submission finished with res
+	 *
+	 * Returns true once the log is read in full, or given up on.
+	 */
+	bool completed(size_t idx, PendingRead &p, int res) {
+		if (p.fd < 0) {
+			if (res < 0) {
+				read_failed(p, "open", -res);
+				return true;
+			}
+			p.fd = res;
+			if (!size_buffer(p))
+				return finish(p);
+			queue_read(idx, p);
+			return false;
+		}
+
+		if (res == -EINTR || res == -EAGAIN) {
+			queue_read(idx, p);
+			return false;
+		}
+		if (res < 0) {
+			read_failed(p, "read", -res);
+			return finish(p);
+		}
+		p.got += res;
+		/* Stop early if the log shrank since it was opened */
+		if (res > 0 && p.got < p.data.size()) {
+			queue_read(idx, p);
+			return false;
+		}
+		p.data.resize(p.got);
+		return finish(p);
+	}
+
+	bool finish(PendingRead &p) {
+		close(p.fd);
+		p.fd = -1;
+		return true;
+	}
+
+	/* submit - Submit everything queued, and wait for wait_nr completions */
+	void submit(unsigned wait_nr) {
+		__atomic_store_n(sq_tail, sqe_tail, __ATOMIC_RELEASE);
+		for (;;) {
+			int ret = syscall(__NR_io_uring_enter, ring_fd, to_submit, wait_nr,
+					  wait_nr ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+
+			if (ret >= 0) {
+				to_submit -= ret;
+				if (!to_submit)
+					return;
+			} else if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+				std::cerr << "io_uring_enter failed: " << strerror(errno) << '\n';
+				exit(1);
+			}
+		}
+	}
+
+	int ring_fd;
+	void *sq_ptr, *cq_ptr;
+	io_uring_sqe *sqes;
+	size_t sq_len, cq_len, sqes_len;
+
+	unsigned *sq_tail, *sq_array, sq_mask;
+	unsigned *cq_head, *cq_tail, cq_mask;
+	io_uring_cqe *cqes;
+
+	/* sqe_tail: Tail of the submissions, including those not yet submitted */
+	unsigned sqe_tail;
+	unsigned to_submit;
+
+	/* pending: Logs being read, by idx */
+	std::unordered_map<size_t, PendingRead *> pending;
+};
+
+/*
+ * ThreadReader - Reads logs with blocking reads on a pool of threads
+ */
+class ThreadReader : public ReadBackend {
+public:
+	ThreadReader(unsigned num_threads) : work(READ_AHEAD), finished(READ_AHEAD) {
+		for (unsigned i = 0; i < num_threads; i++) {
+			threads.emplace_back([this]() {
+				std::pair<size_t, PendingRead *> w;
+
+				while (work.pop(w)) {
+					read_whole(*w.second);
+					finished.push(w.first);
+				}
+			});
+		}
+	}
+
+	~ThreadReader(void) {
+		work.close();
+		for (auto &t : threads)
+			t.join();
+	}
+
+	void start(size_t idx, PendingRead &p) override {
+		work.push({idx, &p});
+	}
+
+	void wait(std::vector<size_t> &done) override {
+		size_t idx;
+
+		finished.pop(idx);
+		done.push_back(idx);
+	}
+
+private:
+	static void read_whole(PendingRead &p) {
+		p.fd = open(p.log.file_path().c_str(), O_RDONLY | O_CLOEXEC);
+		if (p.fd < 0) {
+			read_failed(p, "open", errno);
+			return;
+		}
+		if (size_buffer(p)) {
+			while (p.got < p.data.size()) {
+				ssize_t nr = pread(p.fd, p.data.data() + p.got,
+						   p.data.size() - p.got, p.got);
+
+				if (nr < 0 && errno == EINTR)
+					continue;
+				if (nr < 0) {
+					read_failed(p, "read", errno);
+					break;
+				}
+				if (nr == 0)
+					break;
+				p.got += nr;
+			}
+			p.data.resize(p.got);
+		}
+		close(p.fd);
+		p.fd = -1;
+	}
+
+	/* work, finished: Logs to read, and the idx of those that are read */
+	BoundedQueue<std::pair<size_t, PendingRead *>> work;
+	BoundedQueue<size_t> finished;
+	std::vector<std::thread> threads;
+};
+
+static std::unique_ptr<ReadBackend> open_backend(void)
+{
+	auto uring = std::make_unique<UringReader>(READ_AHEAD);
+
+	if (uring->is_ready())
+		return uring;
+	return std::make_unique<ThreadReader>(READ_THREADS);
+}
+
+/*
+ * read_logs - Read every log in logs, handing each to consume in order
+ *
+ * consume runs on the calling thread, while the logs after it are read.
+ * Compressed logs are left for consume to stream itself, and are handed
+ * to it without any data.
+ */
+void read_logs(const std::vector<LogFile> &logs,
+	       const std::function<void(const LogFile &, std::string_view)> &consume)
+{
+	BoundedQueue<std::pair<size_t, std::string>> ready(READ_QUEUE);
+	std::pair<size_t, std::string> r;
+
+	std::thread reader([&]() {
+		std::unique_ptr<ReadBackend> backend = open_backend();
+		std::map<size_t, std::unique_ptr<PendingRead>> reading;
+		std::vector<size_t> done;
+		size_t next = 0, next_out = 0;
+
+		while (next_out < logs.size()) {
+			/* Keep as many logs being read as we are allowed */
+			for (; next < logs.size() && next - next_out < READ_AHEAD; next++) {
+				auto p = std::make_unique<PendingRead>(logs[next]);
+
+				if (logs[next].compression() != Compression::NONE) {
+					p->finished = true;
+				} else {
+					STAT_ADD(STAT_FILES, 1);
+					backend->start(next, *p);
+				}
+				reading.emplace(next, std::move(p));
+			}
+
+			/* Logs can finish in any order, but go out in order */
+			auto it = reading.begin();
+			if (it->second->finished) {
+				ready.push({next_out++, std::move(it->second->data)});
+				reading.erase(it);
+				continue;
+			}
+
+			done.clear();
+			{
+				/* Reads overlap the parsing, this is only time spent waiting on them */
+				STAT_TIME(STAT_OPEN_TIME);
+				backend->wait(done);
+			}
+			for (size_t idx : done)
+				reading[idx]->finished = true;
+		}
+		ready.close();
+	});
+
+	while (ready.pop(r))
+		consume(logs[r.first], r.second);
+	reader.join();
+}
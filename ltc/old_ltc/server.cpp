@@ -0,0 +1,597 @@
+/*
+ * ltc server
+ *
+ * Keeps client databases in memory and answers queries about them over a
+ * local Unix socket. This way callers (the webserver, the bot) don't pay
+ * for starting a process and reparsing every log on each request.
+ *
+ * A query is a single line of words:
+ * 	top N		- Same as the -h flag
+ * 	tail N		- Same as the -t flag
+ * 	since MM-DD-YYYY	- Same as the -d flag
+ * 	secs		- Same as the -s flag
+ * 	text, json, csv, bin	- Same as the -o flag
+ * e.g. "since 06-01-2021 top 10 secs". The reply is exactly what ltc
+ * would have printed when given the matching flags, after which the
+ * connection is closed. Clients have CLIENT_TIMEOUT seconds to send their
+ * query and read the reply.
+ *
+ * Analyses (hour, weekday, day, week, peak, online - the same as -A) take:
+ * 	client ID	- Same as the -C flag
+ * 	since MM-DD-YYYY	- Start of the window, no earlier than -d
+ * 	until MM-DD-YYYY	- Same as the -u flag
+ * e.g. "weekday client 42 since 01-01-2021". They are answered from the
+ * sessions kept by the default tally, so no window ever needs a reparse,
+ * but no window can start before the server's own -d date either.
+ *
+ * Those sessions stay in memory for as long as the server runs, about 24
+ * bytes each. With -f that grows by one for every connection that ends,
+ * so a server left following for a long time is best given a -d date.
+ *
+ * Every tally shares one day index, so a "since" query only ever reads
+ * the part of the logs from that day on, even the first time it is asked.
+ *
+ * When following (-f), lines appended to the newest log are applied to the
+ * databases as soon as inotify says they were written, and clients who are
+ * still connected have their current connection counted up until the time
+ * of the query.
+ */
+#include <poll.h>
+#include <signal.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "ltc.h"
+
+/* Most databases (one per distinct "since" date) kept in memory at once */
+#define MAX_TALLIES 8
+#define MAX_QUERY_LEN 512
+
+/* Most clients served at once, and the seconds each one gets */
+#define MAX_CLIENTS 64
+#define CLIENT_TIMEOUT 5
+
+/*
+ * Tally - A client database kept up to date for one time constraint
+ */
+struct Tally {
+	Tally(time_t constraint) : ckpt(constraint), generation(0), last_used(0) { }
+
+	/* ckpt: How far into each log db is */
+	Checkpoint ckpt;
+
+	ClientDatabase db;
+
+	/* sorted: Every client in db, from most time connected to the least */
+	std::vector<const Client *> sorted;
+
+	/* generation: Log directory generation db was last brought up to */
+	uint64_t generation;
+
+	/* last_used: Query number this tally was last used for */
+	uint64_t last_used;
+};
+
+class Server {
+public:
+	Server(const char *dir, const struct ProgArgs &a) :
+		log_dir(dir), args(a), generation(1), num_queries(0)
+	{
+		if (args.index_path)
+			index.load(args.index_path);
+	}
+
+	/*
+	 * get_tally - Return an up to date tally for the time constraint
+	 *
+	 * Tallies are only brought up to date when the log directory changed
+	 * since their last update, which is what makes the common case of
+	 * asking the same thing over and over cheap.
+	 */
+	Tally &get_tally(time_t constraint) {
+		auto res = tallies.find(constraint);
+
+		if (res == tallies.end()) {
+			if (tallies.size() >= MAX_TALLIES)
+				evict_tally();
+			res = tallies.emplace(constraint, Tally(constraint)).first;
+			if (constraint == args.time_constraint)
+				res->second.db.record_sessions();
+			if (args.close_at_end)
+				res->second.db.close_at_end();
+			if (args.checkpoint_path && constraint == args.time_constraint &&
+			    !res->second.ckpt.load(args.checkpoint_path, res->second.db)) {
+				res->second.db.clear();
+				res->second.ckpt.logs.clear();
+			}
+		}
+
+		Tally &t = res->second;
+		t.last_used = ++num_queries;
+		if (t.generation != generation)
+			refresh(t);
+		return t;
+	}
+
+	/* Called whenever something in the log directory changed */
+	void mark_dirty(void) {
+		generation++;
+	}
+
+	/*
+	 * follow_append - Apply what was just appended to the log name
+	 *
+	 * Only the newest log is ever appended to. If name is not the newest
+	 * log some tally knows about, that tally has missed something and is
+	 * left for a full refresh.
+	 */
+	void follow_append(std::string_view name) {
+		for (auto &[constraint, t] : tallies) {
+			if (t.generation != generation)
+				continue;
+			if (t.ckpt.logs.empty() || t.ckpt.logs.back().name != name) {
+				t.generation = 0;
+				continue;
+			}
+
+			CheckpointLog &last = t.ckpt.logs.back();
+			LogFile l(0, log_dir + "/" + std::string(name));
+
+			last = parse_log_from(t.db, l, last.offset, true, constraint, &index);
+			t.sorted = sort_clients(t.db);
+		}
+	}
+
+	/* Bring every tally up to date right away, rather than on its next query */
+	void refresh_all(void) {
+		for (auto &[constraint, t] : tallies) {
+			if (t.generation != generation)
+				refresh(t);
+		}
+	}
+
+	/*
+	 * Save the default tally and the index, so the next server starts off
+	 * from them
+	 */
+	void save_checkpoint(void) {
+		auto res = tallies.find(args.time_constraint);
+
+		if (args.checkpoint_path && res != tallies.end() &&
+		    !res->second.ckpt.save(args.checkpoint_path, res->second.db))
+			std::cerr << "Failed to write checkpoint '"
+				<< args.checkpoint_path << "'!\n";
+		if (args.index_path && !index.save(args.index_path))
+			std::cerr << "Failed to write index '"
+				<< args.index_path << "'!\n";
+	}
+
+private:
+	void refresh(Tally &t) {
+		struct ProgArgs targs = args;
+		std::vector<LogFile> logs = compile_logs(log_dir, args.manifest_path);
+
+		targs.time_constraint = t.ckpt.time_constraint;
+		update_from_checkpoint(t.ckpt, t.db, logs, targs, &index);
+		index.retain(logs);
+		t.sorted = sort_clients(t.db);
+		t.generation = generation;
+		/* Followed appends are saved on the way out instead */
+		if (!args.follow && targs.time_constraint == args.time_constraint)
+			save_checkpoint();
+	}
+
+	/* Drop the least recently used tally, but never the default one */
+	void evict_tally(void) {
+		auto victim = tallies.end();
+
+		for (auto it = tallies.begin(); it != tallies.end(); it++) {
+			if (it->first == args.time_constraint)
+				continue;
+			if (victim == tallies.end() ||
+			    it->second.last_used < victim->second.last_used)
+				victim = it;
+		}
+		if (victim != tallies.end())
+			tallies.erase(victim);
+	}
+
+	/* log_dir: Directory holding the teamspeak logs */
+	std::string log_dir;
+
+	/* args: Flags the server was started with, the default for queries */
+	struct ProgArgs args;
+
+	/* generation: Bumped every time the log directory changes */
+	uint64_t generation;
+
+	/* num_queries: Number of tallies handed out so far */
+	uint64_t num_queries;
+
+	/* index: Day index of the logs, shared by every tally */
+	LogIndex index;
+
+	std::map<time_t, Tally> tallies;
+};
+
+static volatile sig_atomic_t server_running = 1;
+
+static void server_stop_handler(int signum)
+{
+	(void) signum;
+	server_running = 0;
+}
+
+/*
+ * parse_query - Turn a query line into the flags it stands for
+ *
+ * Returns nullptr on success, or a description of what is wrong with it.
+ */
+static const char *parse_query(char *line, struct ProgArgs &q)
+{
+	char *save, *word;
+
+	for (word = strtok_r(line, " \t\r\n", &save); word;
+	     word = strtok_r(nullptr, " \t\r\n", &save)) {
+		if (!strcmp(word, "secs")) {
+			q.time_in_seconds = true;
+		} else if (!strcmp(word, "top") || !strcmp(word, "tail")) {
+			char *arg = strtok_r(nullptr, " \t\r\n", &save), *end;
+			long val;
+
+			if (!arg)
+				return "missing count";
+			val = strtol(arg, &end, 10);
+			if (end == arg || *end || val < 0 || val >= INT_MAX)
+				return "bad count";
+			if (*word == 't' && word[1] == 'o') {
+				q.head_count = val;
+				q.tail_count = 0;
+			} else {
+				q.tail_count = val;
+				q.head_count = 0;
+			}
+		} else if (parse_analysis_arg(word, q.analysis) ||
+			   parse_format_arg(word, q.format)) {
+			continue;
+		} else if (!strcmp(word, "client")) {
+			char *arg = strtok_r(nullptr, " \t\r\n", &save), *end;
+			long val;
+
+			if (!arg)
+				return "missing client id";
+			val = strtol(arg, &end, 10);
+			if (end == arg || *end || val < 2 || val >= INT_MAX)
+				return "bad client id";
+			q.client_filter = val;
+		} else if (!strcmp(word, "until")) {
+			char *arg = strtok_r(nullptr, " \t\r\n", &save);
+
+			if (!arg || !parse_date_arg(arg, q.window_end))
+				return "bad date, expected MM-DD-YYYY";
+		} else if (!strcmp(word, "since")) {
+			char *arg = strtok_r(nullptr, " \t\r\n", &save);
+
+			if (!arg || !parse_date_arg(arg, q.time_constraint))
+				return "bad date, expected MM-DD-YYYY";
+		} else {
+			return "unknown query";
+		}
+	}
+	return nullptr;
+}
+
+/*
+ * Conn - A client connection being served
+ *
+ * Sockets are non-blocking and everything waits on the poll loop, so a
+ * client that is slow to send its query or to read a big reply only ever
+ * holds up itself. One that takes longer than CLIENT_TIMEOUT is dropped.
+ */
+struct Conn {
+	Conn(int fd) : fd(fd), sent(0), answered(false),
+		deadline(std::chrono::steady_clock::now() +
+			 std::chrono::seconds(CLIENT_TIMEOUT)) { }
+
+	int fd;
+
+	/* query: As much of the query as has been read */
+	std::string query;
+
+	/* reply & sent: The answer once there is one, and how much went out */
+	std::string reply;
+	size_t sent;
+	bool answered;
+
+	std::chrono::steady_clock::time_point deadline;
+};
+
+/*
+ * answer_query - Work out the reply to query
+ */
+static std::string answer_query(Server &server, std::string &query,
+				const struct ProgArgs &args)
+{
+	struct ProgArgs q = args;
+	std::string reply;
+	const char *err;
+
+	err = parse_query(query.data(), q);
+	if (err)
+		return std::string("error: ") + err + "\n";
+
+	if (q.analysis != Analysis::NONE) {
+		std::ostringstream out;
+
+		/* Only the default tally keeps sessions, and it starts at -d */
+		if (q.time_constraint < args.time_constraint)
+			return "error: window starts before the server's -d date\n";
+		q.window_start = q.time_constraint;
+		print_analysis(out, server.get_tally(args.time_constraint).db, q);
+		return out.str();
+	}
+
+	Tally &t = server.get_tally(q.time_constraint);
+	if (args.follow) {
+		/* Open connections keep growing, so the order has to be redone */
+		q.live_time = log_time_now();
+		format_clients(reply, t.db, sort_clients(t.db, q.live_time, &q), q);
+	} else if (args.close_at_end) {
+		/* Same as closing what the newest log left open, but it may go on */
+		q.live_time = t.db.last_seen();
+		format_clients(reply, t.db, sort_clients(t.db, q.live_time, &q), q);
+	} else {
+		format_clients(reply, t.db, t.sorted, q);
+	}
+	return reply;
+}
+
+/*
+ * read_query - Read whatever of c's query has arrived
+ *
+ * Returns 1 once all of it is in, 0 if there is more to come and -1 if the
+ * connection should be dropped.
+ */
+static int read_query(Conn &c)
+{
+	char buf[MAX_QUERY_LEN];
+
+	for (;;) {
+		ssize_t nr = read(c.fd, buf, MAX_QUERY_LEN - 1 - c.query.size());
+
+		if (nr < 0 && errno == EINTR)
+			continue;
+		if (nr < 0)
+			return errno == EAGAIN ? 0 : -1;
+		/* A query without a newline ends with the connection */
+		if (nr == 0)
+			return 1;
+		c.query.append(buf, nr);
+		if (memchr(buf, '\n', nr) || c.query.size() == MAX_QUERY_LEN - 1)
+			return 1;
+	}
+}
+
+/*
+ * send_reply - Send as much of c's reply as the socket takes
+ *
+ * Returns 1 once all of it went out, 0 if there is more to send and -1 if
+ * the connection should be dropped.
+ */
+static int send_reply(Conn &c)
+{
+	while (c.sent < c.reply.size()) {
+		ssize_t nw = write(c.fd, c.reply.data() + c.sent, c.reply.size() - c.sent);
+
+		if (nw < 0 && errno == EINTR)
+			continue;
+		if (nw < 0)
+			return errno == EAGAIN ? 0 : -1;
+		c.sent += nw;
+	}
+	return 1;
+}
+
+/*
+ * serve_client - Move c along now that poll() says revents about it
+ *
+ * Returns false once c is done with, one way or another.
+ */
+static bool serve_client(Server &server, Conn &c, short revents,
+			 bool check_logs, const struct ProgArgs &args)
+{
+	int ret = 0;
+
+	if (!c.answered) {
+		if (!(revents & (POLLIN | POLLHUP | POLLERR)))
+			return true;
+		ret = read_query(c);
+		if (ret <= 0)
+			return !ret;
+		if (check_logs)
+			server.mark_dirty();
+		c.reply = answer_query(server, c.query, args);
+		c.answered = true;
+	} else if (!(revents & (POLLOUT | POLLHUP | POLLERR))) {
+		return true;
+	}
+	/* Most replies fit in the socket right away */
+	return !send_reply(c);
+}
+/*
+ * handle_log_events - Act on everything inotify has to say about the logs
+ */
+static void handle_log_events(Server &server, int inotify_fd, const struct ProgArgs &args)
+{
+	alignas(struct inotify_event) char buf[4096];
+	bool dirty = false;
+	ssize_t len;
+
+	while ((len = read(inotify_fd, buf, sizeof(buf))) > 0) {
+		const struct inotify_event *ev;
+
+		for (char *p = buf; p < buf + len; p += sizeof(*ev) + ev->len) {
+			ev = (const struct inotify_event *) p;
+
+			/*
+			 * Without following, what changed does not matter, just
+			 * that something did.
+			 */
+			if (args.follow && (ev->mask & IN_MODIFY) && ev->len &&
+			    strstr(ev->name, "_1.log"))
+				server.follow_append(ev->name);
+			else
+				dirty = true;
+		}
+	}
+	if (dirty) {
+		server.mark_dirty();
+		if (args.follow)
+			server.refresh_all();
+	}
+}
+
+/*
+ * open_server_socket - Create the listening socket at path
+ *
+ * A socket file left behind by a server that died is removed, but one
+ * that something is still listening on is left alone.
+ */
+static int open_server_socket(const char *path)
+{
+	struct sockaddr_un sa;
+	int fd;
+
+	if (strlen(path) >= sizeof(sa.sun_path)) {
+		std::cerr << "Socket path '" << path << "' is too long\n";
+		return -1;
+	}
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	strcpy(sa.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		goto sock_fail;
+	if (!connect(fd, (struct sockaddr *) &sa, sizeof(sa))) {
+		std::cerr << "A server is already listening on '" << path << "'\n";
+		close(fd);
+		return -1;
+	}
+	unlink(path);
+	if (bind(fd, (struct sockaddr *) &sa, sizeof(sa)) < 0 || listen(fd, 16) < 0)
+		goto sock_fail;
+	return fd;
+sock_fail:
+	std::cerr << "Failed to set up socket '" << path << "': "
+		<< strerror(errno) << '\n';
+	if (fd >= 0)
+		close(fd);
+	return -1;
+}
+
+/*
+ * run_server - Serve queries on sock_path until told to stop
+ */
+int run_server(const char *sock_path, const char *log_dir, const struct ProgArgs &args)
+{
+	struct sigaction sa;
+	std::vector<struct pollfd> fds;
+	std::vector<Conn> conns;
+	Server server(log_dir, args);
+	int listen_fd, inotify_fd;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = server_stop_handler;
+	sigaction(SIGTERM, &sa, nullptr);
+	sigaction(SIGINT, &sa, nullptr);
+	sa.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &sa, nullptr);
+
+	listen_fd = open_server_socket(sock_path);
+	if (listen_fd < 0)
+		return 1;
+
+	/*
+	 * Without inotify we have no idea when the logs change, so every
+	 * query has to check for itself.
+	 */
+	inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (inotify_fd >= 0 &&
+	    inotify_add_watch(inotify_fd, log_dir, IN_CREATE | IN_DELETE |
+			IN_MODIFY | IN_MOVED_FROM | IN_MOVED_TO) < 0) {
+		close(inotify_fd);
+		inotify_fd = -1;
+	}
+	if (inotify_fd < 0)
+		std::cerr << "Not watching '" << log_dir << "': "
+			<< strerror(errno) << '\n';
+
+	/* Get the default database ready before the first query shows up */
+	server.get_tally(args.time_constraint);
+
+	while (server_running) {
+		auto now = std::chrono::steady_clock::now();
+		int timeout = -1;
+
+		fds.clear();
+		/* At most MAX_CLIENTS at once, the rest wait in the backlog */
+		fds.push_back({ .fd = listen_fd,
+				.events = (short) (conns.size() < MAX_CLIENTS ? POLLIN : 0),
+				.revents = 0 });
+		fds.push_back({ .fd = inotify_fd, .events = POLLIN, .revents = 0 });
+		for (const Conn &c : conns) {
+			auto left = std::chrono::ceil<std::chrono::milliseconds>(
+					c.deadline - now).count();
+
+			fds.push_back({ .fd = c.fd,
+					.events = (short) (c.answered ? POLLOUT : POLLIN),
+					.revents = 0 });
+			if (timeout < 0 || left < timeout)
+				timeout = std::max<long>(left, 0);
+		}
+
+		if (poll(fds.data(), fds.size(), timeout) < 0) {
+			if (errno != EINTR) {
+				std::cerr << "poll: " << strerror(errno) << '\n';
+				/* Whatever it is, trying again right away won't help */
+				sleep(1);
+			}
+			continue;
+		}
+
+		if (fds[1].revents & POLLIN)
+			handle_log_events(server, inotify_fd, args);
+
+		now = std::chrono::steady_clock::now();
+		for (size_t i = 0; i < conns.size(); i++) {
+			Conn &c = conns[i];
+
+			if (!serve_client(server, c, fds[i + 2].revents, inotify_fd < 0, args) ||
+			    now >= c.deadline) {
+				close(c.fd);
+				c.fd = -1;
+			}
+		}
+		conns.erase(std::remove_if(conns.begin(), conns.end(),
+				[](const Conn &c) { return c.fd < 0; }), conns.end());
+
+		if ((fds[0].revents & POLLIN) && conns.size() < MAX_CLIENTS) {
+			int fd = accept4(listen_fd, nullptr, nullptr,
+					 SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+			if (fd >= 0)
+				conns.emplace_back(fd);
+		}
+	}
+
+	for (const Conn &c : conns)
+		close(c.fd);
+	if (args.follow)
+		server.save_checkpoint();
+	if (inotify_fd >= 0)
+		close(inotify_fd);
+	close(listen_fd);
+	unlink(sock_path);
+	return 0;
+}
@@ -0,0 +1,50 @@
+/*
+ * Profiling counters, see the top of ltc.h
+ */
+#include "ltc.h"
+
+#ifdef LTC_STATS
+static std::atomic<uint64_t> stat_totals[NUM_STATS];
+
+thread_local StatBlock thread_stats;
+
+/* When the program started, on both clocks, to work out ticks per second */
+static const uint64_t start_ticks = stat_clock();
+static const auto start_time = std::chrono::steady_clock::now();
+
+StatBlock::~StatBlock(void)
+{
+	for (int i = 0; i < NUM_STATS; i++)
+		stat_totals[i].fetch_add(val[i], std::memory_order_relaxed);
+}
+
+/*
+ * print_stats - Print every counter, then every timer in milliseconds
+ *
+ * One "name value" pair a line, all of them starting with "stat.".
+ * Threads that have not exited yet are not counted, other than this one.
+ */
+void print_stats(std::ostream &out)
+{
+	static const char *const names[NUM_STATS] = {
+		"files", "bytes", "lines", "matched", "parse_failures", "clients",
+		"dup_connects", "lost_disconnects",
+		"list_ms", "open_ms", "scan_ms", "timestamp_ms", "db_ms", "sort_ms",
+		"output_ms",
+	};
+	double secs = std::chrono::duration<double>(
+		std::chrono::steady_clock::now() - start_time).count();
+	double ms_per_tick = secs > 0 ? 1000 * secs / (stat_clock() - start_ticks) : 0;
+
+	for (int i = 0; i < NUM_STATS; i++) {
+		uint64_t val = stat_totals[i] + thread_stats.val[i];
+
+		out << "stat." << names[i] << ' ';
+		if (i >= STAT_LIST_TIME)
+			out << std::fixed << std::setprecision(3) << val * ms_per_tick;
+		else
+			out << val;
+		out << '\n';
+	}
+}
+#endif
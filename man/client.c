@@ -11,6 +11,9 @@
 #include <unistd.h>
 #include "manager.h"
 
+/* reply_ok - Whether the last reply from the manager was "OK" */
+static int reply_ok;
+
 static void die(const char *fmt, ...)
 {
 	va_list argp;
@@ -29,8 +32,11 @@ static inline int sanitize_command(const char *cmd)
 		return 0;
 	if (!strcmp(cmd, "enable") ||
 	    !strcmp(cmd, "disable") ||
-	    !strcmp(cmd, "restart"))
+	    !strcmp(cmd, "restart") ||
+	    !strcmp(cmd, "follow"))
 		return 1;
+	if (!strcmp(cmd, "tail"))
+		return 2;
 	if (!strcmp(cmd, "test2"))
 		return 2;
 	return -1;
@@ -76,6 +82,64 @@ static int connect_to_manager(void)
 	return sock;
 }
 
+/* read_all - read() exactly len bytes, returns -1 if they never all show up */
+static int read_all(int sock, void *buf, size_t len)
+{
+	while (len) {
+		ssize_t nr = read(sock, buf, len);
+
+		if (nr <= 0)
+			return -1;
+		buf = (char *) buf + nr;
+		len -= nr;
+	}
+	return 0;
+}
+
+/*
+ * read_reply - Read the manager's reply to a command, and print it
+ *
+ * Replies are laid out the same way as messages (see send_cmd()).
+ */
+static int read_reply(int sock)
+{
+	uint32_t len;
+	char *reply;
+
+	if (read_all(sock, &len, sizeof(len)) < 0)
+		return -1;
+	len = ntohl(len);
+	if (len > MOD_HISTORY_SIZE)
+		die("Reply from the manager is too long (%u bytes)", len);
+	reply = malloc(len + 1);
+	if (!reply)
+		die("malloc() error");
+	if (read_all(sock, reply, len) < 0) {
+		free(reply);
+		return -1;
+	}
+	reply[len] = '\0';
+	reply_ok = !strcmp(reply, "OK");
+	printf("%s\n", reply);
+	free(reply);
+	return 0;
+}
+
+/*
+ * follow_output - Print whatever the manager sends, until it hangs up
+ *
+ * What comes after the reply to "follow".
+ */
+static void follow_output(int sock)
+{
+	char buf[4096];
+	ssize_t nr;
+
+	fflush(stdout);
+	while ((nr = read(sock, buf, sizeof(buf))) > 0)
+		write(STDOUT_FILENO, buf, nr);
+}
+
 /*
  * send_cmd - Send a command to the manager
  * Layout of a message:
@@ -87,7 +151,6 @@ static int connect_to_manager(void)
  */
 static int send_cmd(char *buf, int bytes, int sock)
 {
-	int ret;
 	uint32_t serial_bytes;
 
 	if (cmd_is_empty(buf))
@@ -97,14 +160,8 @@ static int send_cmd(char *buf, int bytes, int sock)
 	memmove(buf + sizeof(serial_bytes), buf, bytes);
 	memcpy(buf, &serial_bytes, sizeof(serial_bytes));
 	write(sock, buf, bytes + sizeof(serial_bytes));
-	if (serial_bytes != -1) {
-		ret = read(sock, buf, MAX_CMD_LEN - 1);
-		if (ret > 0) {
-			buf[ret] = '\0';
-			printf("%s\n", buf);
-			return 0;
-		}
-	}
+	if (serial_bytes != -1)
+		return read_reply(sock);
 	return -1;
 }
 
@@ -119,7 +176,8 @@ static void build_message(char *b, const char **args, int num_extra)
 	char *const end = b + MAX_CMD_LEN;
 
 	b += snprintf(b, end - b, "%s", *args++);
-	while (b < end && num_extra--)
+	/* Extra arguments may be left off, "tail" has an optional line count */
+	while (b < end && num_extra-- && *args)
 		b += snprintf(b, end - b, " %s", *args++);
 	if (b >= end)
 		die("Inputted command is too long!");
@@ -153,7 +211,9 @@ int try_send(const char **args, int optidx)
 	if (cmd_is_empty(msg))
 		return 0;
 	sock = connect_to_manager();
-	send_cmd(msg, strlen(msg), sock);
+	if (!send_cmd(msg, strlen(msg), sock) && reply_ok &&
+	    !strcmp(*send_args, "follow"))
+		follow_output(sock);
 	close(sock);
 	free(msg);
 	return 0;
@@ -177,7 +237,7 @@ static int wait_next_command(int sock)
 	const char *prompt = "[manager]$ ";
 	size_t prompt_len = strlen(prompt);
 	char *nl, buf[MAX_CMD_LEN];
-	int ret;
+	int ret, follow;
 
 	/* Prompt for input */
 	write(STDOUT_FILENO, prompt, prompt_len);
@@ -194,7 +254,14 @@ static int wait_next_command(int sock)
 	nl = strchr(buf, '\n');
 	if (nl)
 		*nl = '\0';
-	return send_cmd(buf, ret, sock);
+	/* Nothing but output comes back after a follow, so that ends the session */
+	follow = !strncmp(buf, "follow", strlen("follow"));
+	ret = send_cmd(buf, ret, sock);
+	if (!ret && reply_ok && follow) {
+		follow_output(sock);
+		return -1;
+	}
+	return ret;
 }
 
 /*
@@ -0,0 +1,420 @@
+/*
+ * Log rotation
+ *
+ * Left alone, the log file grows for as long as the manager runs. Instead,
+ * once it grows past max_size bytes, or has been written to for max_age
+ * seconds, the log writer thread moves it aside (to path.YYYYmmdd-HHMMSS)
+ * and carries on in a fresh one. Moving it aside is a rename() and an
+ * open(), which never takes long, and while it happens messages keep on
+ * piling up in the writer's ring as always.
+ *
+ * The old logs are gzip'ed by a thread of their own, running at a lower
+ * priority, which then deletes all but the newest keep of them. The
+ * writer only ever tells it the name of the newest old log it is done
+ * with, so it never waits on compression. Everything up to that name is
+ * fair game, including old logs left over by an earlier run, or by one
+ * that was stopped before the compressor got to them.
+ */
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+#include "log_rotate.h"
+
+#define COMPRESS_NICE 10
+
+struct log_rotator {
+	struct log_rotation rot;
+
+	/* dir & base - Where the log file is, and its name in there */
+	char dir[PATH_MAX];
+	const char *base;
+
+	/* size & opened - How much has gone into the log, since when */
+	uint64_t size;
+	time_t opened;
+
+	/*
+	 * done_upto - Name (in dir) of the newest old log the writer is done
+	 * with, and pending whether the compressor has yet to look at it
+	 */
+	char done_upto[NAME_MAX + 1];
+	int pending;
+
+	/* stopping - Set when the compressor should exit */
+	atomic_int stopping;
+
+	/* running - Whether the log gets rotated at all */
+	int running;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t thread;
+};
+
+static struct log_rotator lr = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+/*
+ * rot_err - Note what went wrong in the log
+ *
+ * Straight from whichever thread it went wrong in, the writer's ring only
+ * takes messages from the manager loop.
+ */
+static void rot_err(const char *what, const char *name)
+{
+	char buf[PATH_MAX + 128];
+	int nw;
+
+	nw = snprintf(buf, sizeof(buf), "[ERR] Log rotation: %s '%s' - %s\n",
+		      what, name, strerror(errno));
+	if (nw > 0 && nw < sizeof(buf))
+		write(STDOUT_FILENO, buf, nw);
+}
+
+/* is_old_log - Whether d is one of the logs moved aside, compressed or not */
+static int is_old_log(const struct dirent *d)
+{
+	size_t len = strlen(lr.base);
+
+	return !strncmp(d->d_name, lr.base, len) && d->d_name[len] == '.' &&
+	       d->d_name[len + 1] >= '0' && d->d_name[len + 1] <= '9';
+}
+
+/* stem_len - Length of name, without any ".gz" */
+static size_t stem_len(const char *name)
+{
+	size_t len = strlen(name);
+
+	return len > 3 && !strcmp(name + len - 3, ".gz") ? len - 3 : len;
+}
+
+/*
+ * cmp_log_names - Which of two old logs is older
+ *
+ * Names sort by when they were moved aside, once the ".gz" is ignored.
+ */
+static int cmp_log_names(const char *a, const char *b)
+{
+	size_t alen = stem_len(a), blen = stem_len(b);
+	int cmp = strncmp(a, b, alen < blen ? alen : blen);
+
+	return cmp ? cmp : (alen > blen) - (alen < blen);
+}
+
+static int cmp_old_logs(const struct dirent **a, const struct dirent **b)
+{
+	return cmp_log_names((*a)->d_name, (*b)->d_name);
+}
+
+/*
+ * scan_old_logs - Every old log there is, oldest first
+ *
+ * Returns how many, or -1 on error. Free them with free_old_logs().
+ */
+static int scan_old_logs(struct dirent ***logs)
+{
+	int n = scandir(lr.dir, logs, is_old_log, cmp_old_logs);
+
+	if (n < 0)
+		rot_err("failed to look for old logs in", lr.dir);
+	return n;
+}
+
+static void free_old_logs(struct dirent **logs, int n)
+{
+	while (n--)
+		free(logs[n]);
+	free(logs);
+}
+
+static void old_log_path(char *buf, size_t len, const char *name)
+{
+	snprintf(buf, len, "%s/%s", lr.dir, name);
+}
+
+/*
+ * prune_old_logs - Delete all but the newest keep old logs
+ */
+static void prune_old_logs(void)
+{
+	struct dirent **logs;
+	char path[PATH_MAX + NAME_MAX + 2];
+	int i, n;
+
+	if (!lr.rot.keep)
+		return;
+	n = scan_old_logs(&logs);
+	for (i = 0; i + lr.rot.keep < n; i++) {
+		old_log_path(path, sizeof(path), logs[i]->d_name);
+		if (unlink(path) < 0 && errno != ENOENT)
+			rot_err("failed to delete", path);
+	}
+	if (n >= 0)
+		free_old_logs(logs, n);
+}
+
+/*
+ * compress_log - gzip the old log at name, replacing it with name.gz
+ */
+static void compress_log(const char *name)
+{
+	char gz_name[PATH_MAX + NAME_MAX + 5], buf[1 << 16];
+	gzFile out;
+	ssize_t nr;
+	int fd;
+
+	fd = open(name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		/* Already pruned */
+		if (errno != ENOENT)
+			rot_err("failed to open", name);
+		return;
+	}
+	snprintf(gz_name, sizeof(gz_name), "%s.gz", name);
+	out = gzopen(gz_name, "wbe");
+	if (!out) {
+		rot_err("failed to create", gz_name);
+		close(fd);
+		return;
+	}
+	while ((nr = read(fd, buf, sizeof(buf))) > 0) {
+		if (gzwrite(out, buf, nr) != nr)
+			break;
+	}
+	if (nr || gzclose(out) != Z_OK) {
+		if (nr)
+			gzclose(out);
+		rot_err("failed to compress", name);
+		unlink(gz_name);
+	} else if (unlink(name) < 0) {
+		rot_err("failed to delete", name);
+	}
+	close(fd);
+}
+
+/*
+ * compress_old_logs - Compress every old log up to upto that isn't yet
+ *
+ * Stops early if the compressor is told to stop, the rest can wait.
+ */
+static void compress_old_logs(const char *upto)
+{
+	struct dirent **logs;
+	char path[PATH_MAX + NAME_MAX + 2];
+	int i, n;
+
+	n = scan_old_logs(&logs);
+	for (i = 0; i < n && !atomic_load(&lr.stopping); i++) {
+		const char *name = logs[i]->d_name;
+
+		if (cmp_log_names(name, upto) > 0)
+			break;
+		if (stem_len(name) != strlen(name))
+			continue;
+		old_log_path(path, sizeof(path), name);
+		compress_log(path);
+	}
+	if (n >= 0)
+		free_old_logs(logs, n);
+}
+
+static void *compressor_main(void *arg)
+{
+	char upto[NAME_MAX + 1];
+
+	/* Compressing is never in a hurry, the manager loop is */
+	setpriority(PRIO_PROCESS, syscall(SYS_gettid), COMPRESS_NICE);
+
+	pthread_mutex_lock(&lr.lock);
+	while (!atomic_load(&lr.stopping)) {
+		if (!lr.pending) {
+			pthread_cond_wait(&lr.cond, &lr.lock);
+			continue;
+		}
+		lr.pending = 0;
+		strcpy(upto, lr.done_upto);
+		pthread_mutex_unlock(&lr.lock);
+
+		compress_old_logs(upto);
+		prune_old_logs();
+
+		pthread_mutex_lock(&lr.lock);
+	}
+	pthread_mutex_unlock(&lr.lock);
+	return NULL;
+}
+
+/*
+ * done_with - Let the compressor have every old log up to name
+ */
+static void done_with(const char *name)
+{
+	pthread_mutex_lock(&lr.lock);
+	snprintf(lr.done_upto, sizeof(lr.done_upto), "%s", name);
+	lr.pending = 1;
+	pthread_cond_signal(&lr.cond);
+	pthread_mutex_unlock(&lr.lock);
+}
+
+/*
+ * old_log_name - Name to move the log aside to, one that is not taken yet
+ */
+static void old_log_name(char *buf, size_t len, time_t now)
+{
+	char stamp[32], gz_name[PATH_MAX + 3];
+	struct stat st;
+	struct tm tm;
+	int i;
+
+	localtime_r(&now, &tm);
+	strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &tm);
+	snprintf(buf, len, "%s.%s", lr.rot.path, stamp);
+	/* More than one a second */
+	for (i = 1; ; i++) {
+		snprintf(gz_name, sizeof(gz_name), "%s.gz", buf);
+		if (stat(buf, &st) < 0 && stat(gz_name, &st) < 0)
+			break;
+		/* Padded, so they sort in order */
+		snprintf(buf, len, "%s.%s-%04d", lr.rot.path, stamp, i);
+	}
+}
+
+/*
+ * rotate_log - Move the log aside and carry on in a fresh one
+ *
+ * If anything goes wrong, the old log stays where it is and in use.
+ */
+static void rotate_log(time_t now)
+{
+	char name[PATH_MAX];
+	int fd;
+
+	old_log_name(name, sizeof(name), now);
+	if (rename(lr.rot.path, name) < 0) {
+		rot_err("failed to move aside", lr.rot.path);
+		goto out;
+	}
+	fd = open(lr.rot.path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		rot_err("failed to create", lr.rot.path);
+		rename(name, lr.rot.path);
+		goto out;
+	}
+	if (dup2(fd, STDOUT_FILENO) < 0) {
+		rot_err("failed to switch over to", lr.rot.path);
+		close(fd);
+		rename(name, lr.rot.path);
+		goto out;
+	}
+	if (dup2(fd, STDERR_FILENO) < 0)
+		rot_err("failed to switch stderr over to", lr.rot.path);
+	close(fd);
+	done_with(name + strlen(lr.rot.path) - strlen(lr.base));
+out:
+	/* Whichever way it went, don't try again until the next one is due */
+	lr.opened = now;
+	lr.size = 0;
+}
+
+/*
+ * log_rotate_if_due - Rotate the log if it got too big or too old
+ *
+ * Only for the log writer thread, right before it writes to the log. A
+ * log nothing went into yet is never too old.
+ */
+void log_rotate_if_due(void)
+{
+	time_t now;
+
+	if (!lr.running || !lr.size)
+		return;
+	time(&now);
+	if ((lr.rot.max_size && lr.size >= lr.rot.max_size) ||
+	    (lr.rot.max_age && now - lr.opened >= lr.rot.max_age))
+		rotate_log(now);
+}
+
+/*
+ * log_rotate_wrote - Count len more bytes as having gone into the log
+ */
+void log_rotate_wrote(size_t len)
+{
+	lr.size += len;
+}
+
+/*
+ * init_log_rotation - Start rotating the log file as rot says
+ *
+ * Has to be called from a thread with every signal blocked, which the
+ * compressor then inherits.
+ */
+int init_log_rotation(const struct log_rotation *rot)
+{
+	struct dirent **logs;
+	struct stat st;
+	const char *slash;
+	int err, n;
+
+	lr.rot = *rot;
+	slash = strrchr(rot->path, '/');
+	if (!slash) {
+		strcpy(lr.dir, ".");
+		lr.base = rot->path;
+	} else {
+		snprintf(lr.dir, sizeof(lr.dir), "%.*s",
+			 (int) (slash - rot->path), rot->path);
+		lr.base = slash + 1;
+	}
+	/* Whatever was written before we got here */
+	if (!fstat(STDOUT_FILENO, &st))
+		lr.size = st.st_size;
+	time(&lr.opened);
+
+	/* Old logs left over from before get compressed too */
+	n = scan_old_logs(&logs);
+	if (n > 0)
+		done_with(logs[n - 1]->d_name);
+	if (n >= 0)
+		free_old_logs(logs, n);
+
+	err = pthread_create(&lr.thread, NULL, compressor_main, NULL);
+	if (err) {
+		errno = err;
+		return -1;
+	}
+	lr.running = 1;
+	return 0;
+}
+
+/*
+ * close_log_rotation - Stop rotating
+ *
+ * Only the old log being compressed right now is finished, the rest are
+ * picked up by the next run.
+ */
+void close_log_rotation(void)
+{
+	if (!lr.running)
+		return;
+	pthread_mutex_lock(&lr.lock);
+	atomic_store(&lr.stopping, 1);
+	pthread_cond_signal(&lr.cond);
+	pthread_mutex_unlock(&lr.lock);
+	pthread_join(lr.thread, NULL);
+	lr.running = 0;
+}
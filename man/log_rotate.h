@@ -0,0 +1,28 @@
+#ifndef _LOG_ROTATE_H_
+#define _LOG_ROTATE_H_
+#include <stddef.h>
+#include <time.h>
+
+/*
+ * log_rotation - When the log file gets rotated, and what is kept of it
+ */
+struct log_rotation {
+	/* path - The log file, as opened on stdout */
+	const char *path;
+
+	/* max_size - Rotate once it grows past this many bytes, 0 for never */
+	size_t max_size;
+
+	/* max_age - Rotate once it has been written to this long, 0 for never */
+	time_t max_age;
+
+	/* keep - How many rotated logs to keep around, 0 for all of them */
+	unsigned int keep;
+};
+
+extern int init_log_rotation(const struct log_rotation *rot);
+extern void close_log_rotation(void);
+extern void log_rotate_if_due(void);
+extern void log_rotate_wrote(size_t len);
+
+#endif
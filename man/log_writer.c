@@ -0,0 +1,436 @@
+/*
+ * Log writer
+ *
+ * Everything the manager logs, and everything its modules print, goes
+ * through here on its way to the log file. Producers copy a message into a
+ * ring buffer and carry on, and a thread of its own writes out whatever
+ * has piled up in the ring with writev(). A slow disk or a full pipe then
+ * only ever holds up that thread, never the manager loop.
+ *
+ * Only the manager loop (and the signal handlers that interrupt it) ever
+ * log, so the ring has one producer and one consumer and needs no lock.
+ * The writer thread never sees a signal, and only needs waking up when it
+ * went to sleep on an empty ring.
+ *
+ * Nothing ever waits for room in the ring. A message that does not fit is
+ * dropped whole, as is one logged by a signal handler while another was
+ * half way in. Module output is kept out of the last LOG_RING_RESERVE
+ * bytes, so a module flooding its output can't crowd out what the manager
+ * itself has to say. Drops are counted, and the writer notes them in the
+ * log once it catches up.
+ *
+ * Module output can also skip the ring altogether (log_splice_output()).
+ * Its pages are spliced into a pipe of the writer's own, and from there on
+ * into the log, without ever being copied. Being forwarded as is, it may
+ * end up interleaved with the manager's own messages anywhere, not only
+ * between lines.
+ *
+ * The writer is also the one to rotate the log file (see log_rotate.c),
+ * right before it writes out a batch.
+ *
+ * Before init_log_writer(), and in forked modules (which have no writer
+ * thread), messages are written straight out instead.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include "log_rotate.h"
+#include "log_writer.h"
+
+#define LOG_RING_SIZE (1 << 20) /* Must be a power of 2 */
+#define LOG_RING_RESERVE (1 << 16) /* Room only the manager's own messages use */
+
+struct log_writer {
+	/*
+	 * ring - Messages waiting to be written. head and tail only ever
+	 * grow, and are taken modulo the size of the ring to index it.
+	 */
+	char ring[LOG_RING_SIZE];
+	_Atomic size_t head;
+	_Atomic size_t tail;
+
+	/*
+	 * fwd - Pipe spliced module output waits in. fwd_in counts every
+	 * byte that ever went in, fwd_out every byte the writer took out.
+	 */
+	int fwd[2];
+	_Atomic uint64_t fwd_in;
+	uint64_t fwd_out;
+
+	/* null_fd - /dev/null, where spliced output that does not fit goes */
+	int null_fd;
+
+	/* wake_fd - eventfd the writer sleeps on while there is nothing to write */
+	int wake_fd;
+
+	/* idle - Set by the writer right before it goes to sleep */
+	atomic_int idle;
+
+	/* stopping - Set when the writer should write what is left and exit */
+	atomic_int stopping;
+
+	/* running - Whether messages go through the writer thread */
+	int running;
+
+	/* appending - Marked while a message is half way into the ring */
+	volatile sig_atomic_t appending;
+
+	/* dropped_* - Everything dropped so far */
+	_Atomic uint64_t dropped_msgs;
+	_Atomic uint64_t dropped_bytes;
+
+	/* reported_msgs - How many drops the log already knows about */
+	uint64_t reported_msgs;
+
+	pthread_t thread;
+};
+
+static struct log_writer lw = { .fwd = { -1, -1 }, .null_fd = -1, .wake_fd = -1 };
+
+static void drop(size_t len)
+{
+	atomic_fetch_add(&lw.dropped_msgs, 1);
+	atomic_fetch_add(&lw.dropped_bytes, len);
+}
+
+/*
+ * write_iov - writev() all of iov to the log, no matter how many tries it takes
+ *
+ * Whatever could not be written is counted as dropped, there being nowhere
+ * else to complain to.
+ */
+static void write_iov(struct iovec *iov, int iovcnt)
+{
+	while (iovcnt) {
+		ssize_t nw = writev(STDOUT_FILENO, iov, iovcnt);
+
+		if (nw < 0) {
+			if (errno == EINTR)
+				continue;
+			for (; iovcnt; iov++, iovcnt--)
+				drop(iov->iov_len);
+			return;
+		}
+		log_rotate_wrote(nw);
+		while (iovcnt && (size_t) nw >= iov->iov_len) {
+			nw -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt) {
+			iov->iov_base = (char *) iov->iov_base + nw;
+			iov->iov_len -= nw;
+		}
+	}
+}
+
+static void write_direct(const char *buf, size_t len)
+{
+	struct iovec iov = { (void *) buf, len };
+
+	write_iov(&iov, 1);
+}
+
+/*
+ * move_out - Move up to len bytes from pipe in to the log
+ *
+ * A log that can't be spliced to (one opened for appending, say) gets a
+ * copy instead.
+ */
+static ssize_t move_out(int in, size_t len, unsigned int flags)
+{
+	char buf[4096];
+	ssize_t n;
+
+	n = splice(in, NULL, STDOUT_FILENO, NULL, len, SPLICE_F_MOVE | flags);
+	if (n >= 0 || errno != EINVAL)
+		return n;
+	n = read(in, buf, len < sizeof(buf) ? len : sizeof(buf));
+	if (n > 0)
+		write_direct(buf, n);
+	return n;
+}
+
+/*
+ * write_fwd - Write out everything spliced into fwd up to fwd_in
+ *
+ * If the log won't take it, it is thrown away, fwd has to be emptied
+ * either way.
+ */
+static void write_fwd(uint64_t fwd_in)
+{
+	while (lw.fwd_out < fwd_in) {
+		size_t len = fwd_in - lw.fwd_out;
+		ssize_t n = move_out(lw.fwd[0], len, 0);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n > 0) {
+			log_rotate_wrote(n);
+		} else {
+			n = splice(lw.fwd[0], NULL, lw.null_fd, NULL, len, 0);
+			if (n <= 0)
+				break;
+			drop(n);
+		}
+		lw.fwd_out += n;
+	}
+}
+
+/*
+ * report_drops - Note any messages dropped since the last time in the log
+ */
+static void report_drops(void)
+{
+	uint64_t msgs = atomic_load(&lw.dropped_msgs);
+	char buf[128];
+	int nw;
+
+	if (msgs == lw.reported_msgs)
+		return;
+	lw.reported_msgs = msgs;
+	nw = snprintf(buf, sizeof(buf),
+		      "[ERR] Log writer fell behind, %llu messages (%llu bytes) dropped so far\n",
+		      (unsigned long long) msgs,
+		      (unsigned long long) atomic_load(&lw.dropped_bytes));
+	if (nw > 0 && nw < sizeof(buf))
+		write_direct(buf, nw);
+}
+
+static void *log_writer_main(void *arg)
+{
+	uint64_t wakeups;
+
+	for (;;) {
+		size_t tail = atomic_load_explicit(&lw.tail, memory_order_relaxed);
+		size_t head = atomic_load(&lw.head);
+		uint64_t fwd_in = atomic_load(&lw.fwd_in);
+		size_t off, len, first;
+		struct iovec iov[2];
+
+		if (head == tail && fwd_in == lw.fwd_out) {
+			if (atomic_load(&lw.stopping))
+				break;
+			/* Go to sleep, unless something showed up in the meantime */
+			atomic_store(&lw.idle, 1);
+			if (atomic_load(&lw.head) != tail ||
+			    atomic_load(&lw.fwd_in) != fwd_in ||
+			    atomic_load(&lw.stopping)) {
+				atomic_store(&lw.idle, 0);
+				continue;
+			}
+			if (read(lw.wake_fd, &wakeups, sizeof(wakeups)) < 0 && errno != EINTR)
+				break;
+			continue;
+		}
+
+		log_rotate_if_due();
+
+		/* Write out everything in the ring, in two pieces if it wraps */
+		if (head != tail) {
+			off = tail & (LOG_RING_SIZE - 1);
+			len = head - tail;
+			first = len < LOG_RING_SIZE - off ? len : LOG_RING_SIZE - off;
+			iov[0].iov_base = lw.ring + off;
+			iov[0].iov_len = first;
+			iov[1].iov_base = lw.ring;
+			iov[1].iov_len = len - first;
+			write_iov(iov, len > first ? 2 : 1);
+			atomic_store(&lw.tail, head);
+		}
+		write_fwd(fwd_in);
+		report_drops();
+	}
+	report_drops();
+	return NULL;
+}
+
+static void wake_writer(void)
+{
+	uint64_t one = 1;
+
+	if (atomic_exchange(&lw.idle, 0))
+		write(lw.wake_fd, &one, sizeof(one));
+}
+
+static void __log_write(const char *buf, size_t len, size_t reserve)
+{
+	size_t head, tail, off, first;
+
+	if (!lw.running) {
+		write_direct(buf, len);
+		return;
+	}
+	/* A signal handler interrupted a message on its way in */
+	if (lw.appending) {
+		drop(len);
+		return;
+	}
+	lw.appending = 1;
+
+	head = atomic_load_explicit(&lw.head, memory_order_relaxed);
+	tail = atomic_load(&lw.tail);
+	if (len + reserve > LOG_RING_SIZE - (head - tail)) {
+		drop(len);
+		lw.appending = 0;
+		return;
+	}
+	off = head & (LOG_RING_SIZE - 1);
+	first = len < LOG_RING_SIZE - off ? len : LOG_RING_SIZE - off;
+	memcpy(lw.ring + off, buf, first);
+	memcpy(lw.ring, buf + first, len - first);
+	atomic_store(&lw.head, head + len);
+	wake_writer();
+	lw.appending = 0;
+}
+
+/*
+ * log_write - Queue up len bytes of buf to be written to the log
+ *
+ * Never blocks, see above for what happens when the writer falls behind.
+ */
+void log_write(const char *buf, size_t len)
+{
+	__log_write(buf, len, 0);
+}
+
+/*
+ * log_write_output - Same as log_write(), for what modules print
+ */
+void log_write_output(const char *buf, size_t len)
+{
+	__log_write(buf, len, LOG_RING_RESERVE);
+}
+
+/*
+ * log_splice_output - Move up to len bytes waiting in pipe fd onto the log
+ *
+ * Only meant for the manager loop, never a signal handler. What does not
+ * fit in fwd is thrown away and counted as dropped, so nothing waits and
+ * fd is drained either way. Returns how many bytes were taken out of fd,
+ * 0 once fd has hung up, or -1 (EAGAIN) if there was nothing in it.
+ */
+ssize_t log_splice_output(int fd, size_t len)
+{
+	size_t moved = 0;
+	ssize_t n;
+
+	if (!lw.running)
+		return move_out(fd, len, SPLICE_F_NONBLOCK);
+
+	do {
+		n = splice(fd, NULL, lw.fwd[1], NULL, len - moved,
+			   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (n > 0)
+			moved += n;
+	} while (moved < len && (n > 0 || (n < 0 && errno == EINTR)));
+	if (moved) {
+		atomic_fetch_add(&lw.fwd_in, moved);
+		wake_writer();
+	}
+	if (!n && !moved)
+		return 0;
+
+	/* fwd is full, out goes the rest */
+	if (n < 0 && errno == EAGAIN && moved < len) {
+		n = splice(fd, NULL, lw.null_fd, NULL, len - moved, SPLICE_F_NONBLOCK);
+		if (n > 0) {
+			drop(n);
+			moved += n;
+		}
+	}
+	if (!moved) {
+		errno = EAGAIN;
+		return -1;
+	}
+	return moved;
+}
+
+static void close_fds(void)
+{
+	int *fds[] = { &lw.fwd[0], &lw.fwd[1], &lw.null_fd, &lw.wake_fd };
+	int i;
+
+	for (i = 0; i < sizeof(fds) / sizeof(fds[0]); i++) {
+		if (*fds[i] >= 0)
+			close(*fds[i]);
+		*fds[i] = -1;
+	}
+}
+
+/*
+ * init_log_writer - Start up the writer thread
+ *
+ * Must be called after daemon(), a thread does not survive a fork. On
+ * failure, messages keep on being written straight out. The log file gets
+ * rotated as rot says, unless rot is NULL.
+ */
+int init_log_writer(const struct log_rotation *rot)
+{
+	static const char rot_fail[] =
+		"[ERR] Failed to start log compressor, log will not be rotated\n";
+	sigset_t all, old;
+	int err;
+
+	lw.wake_fd = eventfd(0, EFD_CLOEXEC);
+	lw.null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+	if (lw.wake_fd < 0 || lw.null_fd < 0 || pipe2(lw.fwd, O_CLOEXEC) < 0 ||
+	    fcntl(lw.fwd[1], F_SETFL, O_NONBLOCK) < 0) {
+		close_fds();
+		return -1;
+	}
+	/* As much room as the ring has, if we are allowed it */
+	fcntl(lw.fwd[1], F_SETPIPE_SZ, LOG_RING_SIZE);
+
+	/* Signals are for the manager loop to handle, keep them off the writer */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	if (rot && init_log_rotation(rot) < 0)
+		write_direct(rot_fail, sizeof(rot_fail) - 1);
+	err = pthread_create(&lw.thread, NULL, log_writer_main, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (err) {
+		close_log_rotation();
+		close_fds();
+		errno = err;
+		return -1;
+	}
+	lw.running = 1;
+	return 0;
+}
+
+/*
+ * close_log_writer - Write out everything still in the ring, then stop the writer
+ */
+void close_log_writer(void)
+{
+	uint64_t one = 1;
+
+	if (!lw.running)
+		return;
+	atomic_store(&lw.stopping, 1);
+	write(lw.wake_fd, &one, sizeof(one));
+	pthread_join(lw.thread, NULL);
+	close_log_rotation();
+	lw.running = 0;
+	close_fds();
+}
+
+/*
+ * log_writer_forked - Write straight out from now on
+ *
+ * For the child side of a fork(), where the writer thread does not exist.
+ */
+void log_writer_forked(void)
+{
+	lw.running = 0;
+}
@@ -0,0 +1,14 @@
+#ifndef _LOG_WRITER_H_
+#define _LOG_WRITER_H_
+#include <stddef.h>
+#include <sys/types.h>
+#include "log_rotate.h"
+
+extern int init_log_writer(const struct log_rotation *rot);
+extern void close_log_writer(void);
+extern void log_writer_forked(void);
+extern void log_write(const char *buf, size_t len);
+extern void log_write_output(const char *buf, size_t len);
+extern ssize_t log_splice_output(int fd, size_t len);
+
+#endif
@@ -6,17 +6,20 @@
  * recover a crashed process.
  */
 
+#define _GNU_SOURCE
 #include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
-#include <poll.h>
+#include <limits.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
 #include <sys/prctl.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
@@ -25,17 +28,27 @@
 #include <time.h>
 #include <unistd.h>
 #include "client.h"
+#include "log_writer.h"
 #include "manager.h"
 #include "session.h"
 
 #define __noreturn __attribute__((__noreturn__))
 
 #define LOG_FILE_PATH "/tmp/ts_manager_log.txt"
+#define LOG_ROTATE_SIZE (64 << 20) /* Rotate the log once it grows past this */
+#define LOG_ROTATE_AGE (24 * 60 * 60) /* Or once it is this old, in seconds */
+#define LOG_ROTATE_KEEP 14 /* Rotated logs kept around */
 #define WEBSERVER_PATH "./tswebserver"
 #define BOT_PATH "./bot.py"
 
 #define LOG_BUF_SIZE (1 << 13)
 #define MAN_POLL_TIMEOUT -1 /* In milliseconds, -1 for no tiemout */
+#define MAN_MAX_EVENTS 64 /* Most ready fds handled per epoll_wait() */
+
+#define MOD_LINE_MAX 1024 /* Longer lines from a module are split up */
+#define MOD_HISTORY_LINES 1024 /* Most lines kept per module for "tail" */
+#define MOD_TAIL_DEFAULT 50 /* Lines "tail" replies with if not told */
+#define MOD_FOLLOW_BUF (1 << 20) /* Most output held for a follower */
 
 #define intr_enable()							\
 	do {								\
@@ -81,6 +94,30 @@
 #define log_err(s, ...) do_log(LOG_ERR, "[ERR] " s, ## __VA_ARGS__)
 #define logv_err(s, ...) do_log(LOG_ERR | LOG_ERRNO, "[ERR] " s, ## __VA_ARGS__)
 
+/*
+ * mod_output - What a module has been printing
+ *
+ * Modules write to their pipe however they like, so output is put back
+ * together into lines before it gets logged, each stamped with when it
+ * was read. The last lines logged are kept around so a session can ask
+ * for them ("tail"), without anyone digging through the log file.
+ */
+struct mod_output {
+	/* line - The line being put together, and how much of it is in */
+	char line[MOD_LINE_MAX];
+	size_t line_len;
+
+	/*
+	 * history - The last lines, exactly as they were logged, in a ring.
+	 * history_end counts every byte that ever went in, and line_starts
+	 * where each of the last MOD_HISTORY_LINES lines started.
+	 */
+	char history[MOD_HISTORY_SIZE];
+	uint64_t history_end;
+	uint64_t line_starts[MOD_HISTORY_LINES];
+	uint64_t num_lines;
+};
+
 struct module {
 	/* pathname & argv - args to be used for exec() calls */
 	const char *mod_name;
@@ -99,7 +136,15 @@ struct module {
 	unsigned int needs_restart;
 	unsigned int state;
 	int wstatus;
-	int pipefd;
+
+	/* pipe - Read end of the pipe the module's output comes through */
+	struct event_source pipe;
+
+	/* output - What came through the pipe so far */
+	struct mod_output output;
+
+	/* followers - Sessions being sent the output as it comes */
+	struct list_node followers;
 };
 #define DEFINE_MODULE(name, init_func, path, ...)		\
 	struct module name = {					\
@@ -107,13 +152,23 @@ struct module {
 		.pathname = path,				\
 		.argv = { __VA_ARGS__, NULL},			\
 		.pid = -1,					\
-		.pipefd = -1,					\
+		.pipe = { .fd = -1, .ready = module_ready },	\
+		.followers = LIST_NODE_INIT(name.followers),	\
 		.init = init_func,				\
 		.state = MODULE_OFF				\
 	}
 
 static struct manager manager;
 
+static const struct log_rotation log_rotation = {
+	.path = LOG_FILE_PATH,
+	.max_size = LOG_ROTATE_SIZE,
+	.max_age = LOG_ROTATE_AGE,
+	.keep = LOG_ROTATE_KEEP,
+};
+
+static void module_ready(struct manager *man, struct event_source *src);
+
 static void init_ts_bot(void);
 static void init_ts_webserver(void);
 static DEFINE_MODULE(ts_bot, &init_ts_bot, "/usr/bin/python", "python", BOT_PATH);
@@ -124,16 +179,15 @@ static struct module *mods[NUM_MODS] = {
 	&ts_webserver,
 };
 
-static char __log_buf[LOG_BUF_SIZE];
-
 static void usage(const char *self)
 {
 	fprintf(stdout,
-		"Usage: %s [-s {command} | [-a] [-w] [-b]]\n"
+		"Usage: %s [-s {command} | [-a] [-w] [-b] [-r]]\n"
 		"  -s    Send a command to the currently running manager\n"
 		"  -a    Start the manager with all modules\n"
 		"  -b    Start the manager with only the bot\n"
 		"  -w    Start the manager with only the webserver\n"
+		"  -r    Log module output as is, not in timestamped lines\n"
 		"\n"
 		"Examples:\n"
 		"  %s -a (Start up the manager)\n"
@@ -145,14 +199,17 @@ static void usage(const char *self)
 /*
  * do_log - Print log string
  *
- * In this function we print to stdout, but the manager uses the
- * stdout file descriptor as a log file
+ * The message is handed to the log writer, which writes it to stdout. The
+ * manager uses the stdout file descriptor as a log file.
+ *
+ * The buffer lives on the stack, since a signal handler may log while
+ * another message is being formatted.
  */
 static void do_log(int log_flags, const char *fmt, ...)
 {
 	va_list argp;
-	size_t nw;
-	char *buffer = __log_buf;
+	int nw;
+	char buffer[LOG_BUF_SIZE];
 	unsigned int flags = log_flags;
 	int errv = errno;
 
@@ -167,13 +224,216 @@ static void do_log(int log_flags, const char *fmt, ...)
 	if (flags & LOG_ERRNO)
 		nw += snprintf(buffer + nw, LOG_BUF_SIZE - nw, " - %s",
 							strerror(errv));
+	if (nw >= LOG_BUF_SIZE)
+		nw = sizeof(buffer) - 1;
 log_fail:
 	buffer[nw] = '\n';
-	write(STDOUT_FILENO, buffer, nw + 1);
+	log_write(buffer, nw + 1);
+	/* exit() gets the writer to write out everything before this */
 	if (flags & LOG_FATAL)
 		exit(1);
 }
 
+/*
+ * history_copy - Copy len bytes of history, starting from byte pos, into buf
+ */
+static void history_copy(const struct mod_output *o, uint64_t pos, char *buf, size_t len)
+{
+	size_t off = pos % MOD_HISTORY_SIZE;
+	size_t first = len < MOD_HISTORY_SIZE - off ? len : MOD_HISTORY_SIZE - off;
+
+	memcpy(buf, o->history + off, first);
+	memcpy(buf + first, o->history, len - first);
+}
+
+static void history_add(struct mod_output *o, const char *buf, size_t len)
+{
+	size_t off = o->history_end % MOD_HISTORY_SIZE;
+	size_t first = len < MOD_HISTORY_SIZE - off ? len : MOD_HISTORY_SIZE - off;
+
+	memcpy(o->history + off, buf, first);
+	memcpy(o->history, buf + first, len - first);
+	o->line_starts[o->num_lines++ % MOD_HISTORY_LINES] = o->history_end;
+	o->history_end += len;
+}
+
+/*
+ * feed_followers - Queue up len bytes of buf for everyone following m
+ *
+ * A follower whose pipe is full misses out on it, the module is never
+ * held up for one that can't keep up. Lines are shorter than PIPE_BUF, so
+ * they are missed out on whole.
+ */
+static void feed_followers(struct module *m, const char *buf, size_t len)
+{
+	struct follower *f;
+
+	list_for_each_entry(f, &m->followers, list) {
+		if (write(f->pipe[1], buf, len) != len)
+			f->missed += len;
+	}
+}
+
+/*
+ * drop_follower_output - Throw away everything queued up for f
+ */
+static void drop_follower_output(struct follower *f)
+{
+	static int null_fd = -1;
+	int queued;
+	ssize_t n;
+
+	if (null_fd < 0)
+		null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+	if (ioctl(f->pipe[0], FIONREAD, &queued) < 0 || !queued)
+		return;
+	n = splice(f->pipe[0], NULL, null_fd, NULL, queued, SPLICE_F_NONBLOCK);
+	if (n > 0)
+		f->missed += n;
+}
+
+/*
+ * flush_followers - Send followers of m whatever their socket has room for
+ *
+ * A follower whose socket is full gets the rest of what was queued up
+ * for it thrown away, rather than have it go stale. One still being sent
+ * a reply has its output wait in its pipe for as long as there is room.
+ */
+static void flush_followers(struct module *m)
+{
+	struct follower *f;
+	ssize_t n;
+
+	list_for_each_entry(f, &m->followers, list) {
+		if (f->sock < 0)
+			continue;
+		n = splice(f->pipe[0], NULL, f->sock, NULL, MOD_FOLLOW_BUF,
+			   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (n < 0 && errno == EAGAIN)
+			drop_follower_output(f);
+	}
+}
+
+/*
+ * follow_module - Start sending f whatever m outputs
+ *
+ * A follower already following another module is moved over.
+ */
+static int follow_module(struct module *m, struct follower *f)
+{
+	manager_unfollow(f);
+	if (pipe2(f->pipe, O_CLOEXEC | O_NONBLOCK) < 0) {
+		logv_err("Failed to set up pipe to follow '%s'", m->mod_name);
+		f->pipe[0] = f->pipe[1] = -1;
+		return -1;
+	}
+	/* Some slack for while the session is busy, if we are allowed it */
+	fcntl(f->pipe[1], F_SETPIPE_SZ, MOD_FOLLOW_BUF);
+	f->mod_name = m->mod_name;
+	f->missed = 0;
+	list_add_post(&f->list, &m->followers);
+	return 0;
+}
+
+/*
+ * manager_unfollow - Stop sending f module output, if it was being sent any
+ */
+void manager_unfollow(struct follower *f)
+{
+	if (f->pipe[0] < 0)
+		return;
+	if (f->missed)
+		log_info("A follower of '%s' could not keep up, missed %llu bytes",
+			 f->mod_name, (unsigned long long) f->missed);
+	list_del(&f->list);
+	close(f->pipe[0]);
+	close(f->pipe[1]);
+	f->pipe[0] = f->pipe[1] = -1;
+}
+
+/*
+ * log_mod_line - Log the line a module has put together so far
+ *
+ * stamp is when it was read.
+ */
+static void log_mod_line(struct module *m, const char *stamp)
+{
+	struct mod_output *o = &m->output;
+	char buf[MOD_LINE_MAX + 128];
+	int nw;
+
+	nw = snprintf(buf, sizeof(buf), "%s [%s] %.*s\n", stamp, m->mod_name,
+		      (int) o->line_len, o->line);
+	o->line_len = 0;
+	if (nw < 0)
+		return;
+	if (nw >= sizeof(buf)) {
+		nw = sizeof(buf);
+		buf[nw - 1] = '\n';
+	}
+	log_write_output(buf, nw);
+	history_add(o, buf, nw);
+	feed_followers(m, buf, nw);
+}
+
+static void format_stamp(char *buf, size_t len)
+{
+	struct tm tm;
+	time_t t;
+
+	time(&t);
+	localtime_r(&t, &tm);
+	strftime(buf, len, "%Y-%m-%d %H:%M:%S", &tm);
+}
+
+/*
+ * flush_mod_line - Log whatever is left of a line that never got finished
+ */
+static void flush_mod_line(struct module *m)
+{
+	char stamp[32];
+
+	if (!m->output.line_len)
+		return;
+	format_stamp(stamp, sizeof(stamp));
+	log_mod_line(m, stamp);
+}
+
+/*
+ * mod_tail - Put the last n lines module m logged into buf
+ *
+ * Only as many lines as fit in len bytes (including the '\0') are given,
+ * and the last one goes without its newline.
+ */
+static void mod_tail(const struct module *m, unsigned long n, char *buf, size_t len)
+{
+	const struct mod_output *o = &m->output;
+	uint64_t first, start, oldest;
+
+	*buf = '\0';
+	if (n > o->num_lines)
+		n = o->num_lines;
+	if (n > MOD_HISTORY_LINES)
+		n = MOD_HISTORY_LINES;
+	if (!n)
+		return;
+
+	/* Skip lines the byte ring already wrapped over, or that don't fit */
+	oldest = o->history_end > MOD_HISTORY_SIZE ? o->history_end - MOD_HISTORY_SIZE : 0;
+	if (o->history_end - oldest >= len)
+		oldest = o->history_end - len + 1;
+	for (first = o->num_lines - n; first < o->num_lines; first++) {
+		if (o->line_starts[first % MOD_HISTORY_LINES] >= oldest)
+			break;
+	}
+	if (first == o->num_lines)
+		return;
+	start = o->line_starts[first % MOD_HISTORY_LINES];
+
+	history_copy(o, start, buf, o->history_end - start);
+	buf[o->history_end - start - 1] = '\0';
+}
+
 /*
  * init_ts_bot - Teamspeak bot startup function
  */
@@ -235,7 +495,7 @@ static int do_module_init(struct module *mod)
 		logv_err("Failed to set up pipe for %s", mod->mod_name);
 		goto bad_init;
 	}
-	mod->pipefd = pipefds[0];
+	mod->pipe.fd = pipefds[0];
 
 	intr_save(flags);
 	cpid = fork();
@@ -244,6 +504,8 @@ static int do_module_init(struct module *mod)
 		logv_err("Failed to fork for %s", mod->mod_name);
 		goto bad_init_cleanup_fork;
 	case 0:
+		/* There is no writer thread over here */
+		log_writer_forked();
 		/* We don't need that read end */
 		if (close(pipefds[0]) < 0) {
 			logv_err("%s: failed to close read end of pipe for '%s'",
@@ -292,12 +554,14 @@ static int do_module_init(struct module *mod)
 		logv_err("Setting O_NONBLOCK on read end of pipe for '%s' failed!"
 			" Manager will for SURE not work as expected!",
 			mod->mod_name);
+	if (manager_watch(&manager, &mod->pipe) < 0)
+		log_err("Output of '%s' will not be logged!", mod->mod_name);
 	manager.mods_dirty = 1;
 	return 0;
 
 bad_init_cleanup_fork:
 	intr_restore(flags);
-	mod->pipefd = -1;
+	mod->pipe.fd = -1;
 	for (i = 0; i < 2; i++)
 		close(pipefds[i]);
 bad_init:
@@ -385,6 +649,60 @@ static int setup_comm_socket(void)
 	return sfd;
 }
 
+/*
+ * manager_watch - Start waiting on src->fd, calling src->ready() once it's ready
+ */
+int manager_watch(struct manager *man, struct event_source *src)
+{
+	struct epoll_event ev = {
+		.events = EPOLLIN,
+		.data.ptr = src,
+	};
+
+	if (epoll_ctl(man->epoll_fd, EPOLL_CTL_ADD, src->fd, &ev) < 0) {
+		logv_err("Failed to watch fd (%d)", src->fd);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * manager_watch_output - Have src->ready() called once src->fd is writable
+ * instead of readable, or the other way around
+ */
+int manager_watch_output(struct manager *man, struct event_source *src, int output)
+{
+	struct epoll_event ev = {
+		.events = output ? EPOLLOUT : EPOLLIN,
+		.data.ptr = src,
+	};
+
+	if (epoll_ctl(man->epoll_fd, EPOLL_CTL_MOD, src->fd, &ev) < 0) {
+		logv_err("Failed to change what fd (%d) is waited on for", src->fd);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * manager_unwatch - Stop waiting on src->fd
+ *
+ * Has to be done before src->fd is closed. Modules forked later hold on to
+ * copies of it, and epoll only forgets about an fd once every copy is gone.
+ */
+void manager_unwatch(struct manager *man, struct event_source *src)
+{
+	/* ENOENT is fine, module_ready() may have let go of it already */
+	if (epoll_ctl(man->epoll_fd, EPOLL_CTL_DEL, src->fd, NULL) < 0 &&
+	    errno != ENOENT)
+		logv_err("Failed to unwatch fd (%d)", src->fd);
+}
+
+static void listen_sock_ready(struct manager *man, struct event_source *src)
+{
+	start_new_session(man);
+}
+
 /*
  * init_manager - initalize log file, daemonzie, set up manager running state
  */
@@ -414,7 +732,20 @@ static void init_manager(void)
 		diev("Error daemonizing");
 	if (close(nullfd) < 0)
 		log_err("Error closing nullfd");
-	manager.listen_sock = setup_comm_socket();
+
+	/* Now that we are the process that sticks around, take logging off the loop */
+	if (init_log_writer(&log_rotation) < 0)
+		logv_err("Failed to start log writer, logging synchronously");
+	else
+		atexit(close_log_writer);
+
+	manager.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (manager.epoll_fd < 0)
+		diev("Error creating epoll instance");
+	manager.listen_sock.fd = setup_comm_socket();
+	manager.listen_sock.ready = listen_sock_ready;
+	if (manager_watch(&manager, &manager.listen_sock) < 0)
+		die("Could not wait on the manager socket");
 }
 
 /*
@@ -439,10 +770,13 @@ static void do_module_exit(struct module *m)
 	manager.mods_dirty = 1;
 	intr_restore(flags);
 
-	if (close(m->pipefd) < 0)
+	manager_unwatch(&manager, &m->pipe);
+	flush_mod_line(m);
+	flush_followers(m);
+	if (close(m->pipe.fd) < 0)
 		logv_err("Error closing read pipe for module: %s",
 				m->mod_name);
-	m->pipefd = -1;
+	m->pipe.fd = -1;
 	m->state = MODULE_EXITED;
 }
 
@@ -465,8 +799,10 @@ static void __noreturn shutdown_manager(void)
 	for (i = 0; i < ARRAY_SIZE(mods); i++)
 		do_module_exit(mods[i]);
 
-	if (close(manager.listen_sock) < 0)
+	if (close(manager.listen_sock.fd) < 0)
 		logv_err("Error closing manager listen socket");
+	if (close(manager.epoll_fd) < 0)
+		logv_err("Error closing manager epoll instance");
 	if (unlink(MANAGER_SOCK_PATH) < 0)
 		logv_err("Error removing manager socket from fs");
 	log_info("Manager shutdown complete.");
@@ -585,12 +921,16 @@ static int do_module_restart(struct module *m)
 	return do_module_init(m);
 }
 
+/*
+ * get_mod - Look up a module by name, the "ts_" in front may be left out
+ */
 static struct module *get_mod(char *req_mod)
 {
 	int i;
 	for (i = 0; i < NUM_MODS; i++) {
 		struct module *m = mods[i];
-		if (!strcmp(m->mod_name, req_mod))
+		if (!strcmp(m->mod_name, req_mod) ||
+		    (!strncmp(m->mod_name, "ts_", 3) && !strcmp(m->mod_name + 3, req_mod)))
 			return m;
 	}
 	return NULL;
@@ -604,6 +944,8 @@ enum manager_cmds {
 	CMD_RESTART_MOD,
 	CMD_DISABLE_MOD,
 	CMD_ENABLE_MOD,
+	CMD_TAIL_MOD,
+	CMD_FOLLOW_MOD,
 };
 
 
@@ -617,10 +959,73 @@ static enum manager_cmds parse_command(const char *input)
 		return CMD_DISABLE_MOD;
 	if (!strncmp(input, "enable", strlen("enable")))
 		return CMD_ENABLE_MOD;
+	if (!strncmp(input, "tail", strlen("tail")))
+		return CMD_TAIL_MOD;
+	if (!strncmp(input, "follow", strlen("follow")))
+		return CMD_FOLLOW_MOD;
 	return CMD_NONE;
 }
 
-const char *manager_process_input(char *input)
+/* next_arg - The next word of input, or NULL if there are no more */
+static char *next_arg(char **input)
+{
+	char *arg;
+
+	while ((arg = strsep(input, " ")) && !*arg)
+		;
+	return arg;
+}
+
+/*
+ * do_module_tail - Answer "tail <module> [lines]"
+ */
+static const char *do_module_tail(char *input)
+{
+	static char resp[MOD_HISTORY_SIZE + 1];
+	unsigned long n = MOD_TAIL_DEFAULT;
+	struct module *m;
+	char *arg, *end;
+
+	next_arg(&input);
+	arg = next_arg(&input);
+	if (!arg)
+		return "No argument given.";
+	m = get_mod(arg);
+	if (!m)
+		return "No such module.";
+	if (manager.raw_output)
+		return "Output is logged as is, there are no lines to tail.";
+	arg = next_arg(&input);
+	if (arg) {
+		n = strtoul(arg, &end, 10);
+		if (*end || !n)
+			return "Bad number of lines.";
+	}
+	mod_tail(m, n, resp, sizeof(resp));
+	return resp;
+}
+
+/*
+ * do_module_follow - Answer "follow <module>"
+ *
+ * From then on, the session is sent the module's output as it comes.
+ */
+static const char *do_module_follow(char *input, struct follower *f)
+{
+	struct module *m;
+	char *arg;
+
+	next_arg(&input);
+	arg = next_arg(&input);
+	if (!arg)
+		return "No argument given.";
+	m = get_mod(arg);
+	if (!m)
+		return "No such module.";
+	return !follow_module(m, f) ? "OK" : "FAIL";
+}
+
+const char *manager_process_input(char *input, struct follower *f)
 {
 	enum manager_cmds cmd;
 	char *arg;
@@ -634,6 +1039,10 @@ const char *manager_process_input(char *input)
 		manager.status = STOPPED;
 		return "Shutting down...";
 	}
+	if (cmd == CMD_TAIL_MOD)
+		return do_module_tail(input);
+	if (cmd == CMD_FOLLOW_MOD)
+		return do_module_follow(input, f);
 
 	input = strchr(input, ' ');
 	if (!input)
@@ -670,81 +1079,95 @@ const char *manager_process_input(char *input)
 /*
  * read_mod_input - Read output from a running module
  *
- * Take the output of the module and write it to the log file.
- * Prepend the name of the module so we can distinguish who is talking.
+ * Take the output of the module and log it a line at a time. Each line
+ * starts with when it was read and the name of the module, so we can
+ * distinguish who is talking and when.
+ *
+ * Every byte gets copied on the way, see forward_mod_output() for what is
+ * done instead when the manager is started with -r.
+ *
+ * Returns 0 once the module has closed its end of the pipe.
  */
-static void read_mod_input(int fd, const char *mod_name)
+static int read_mod_input(struct module *m)
 {
-	char buf[2048];
-	int nr, nw, bytes_left, buf_len;
-
-	buf_len = sizeof(buf);
-	memset(buf, 0, buf_len);
-	nw = snprintf(buf, buf_len, "[%s] ", mod_name);
-	if (nw < 0 || nw >= buf_len) {
-		log_err("%s: %s module name is too long?", __func__, mod_name);
-		nw = snprintf(buf, buf_len, "[???] ");
-	}
-
-	bytes_left = buf_len - nw;
-	while ((nr = read(fd, buf + buf_len - bytes_left, bytes_left)) > 0) {
-		bytes_left -= nr;
-		if (!bytes_left) {
-			/* Flush */
-			write(STDOUT_FILENO, buf, buf_len);
-			bytes_left = buf_len;
+	struct mod_output *o = &m->output;
+	char buf[4096], stamp[32] = "";
+	int nr;
+
+	while ((nr = read(m->pipe.fd, buf, sizeof(buf))) > 0) {
+		const char *p = buf, *end = buf + nr;
+
+		/* Everything read in one go is stamped with the same time */
+		if (!*stamp)
+			format_stamp(stamp, sizeof(stamp));
+		while (p < end) {
+			const char *nl = memchr(p, '\n', end - p);
+			size_t len = (nl ? nl : end) - p;
+			size_t take = MOD_LINE_MAX - o->line_len;
+
+			if (take > len)
+				take = len;
+			memcpy(o->line + o->line_len, p, take);
+			o->line_len += take;
+			p += take;
+			if (nl && take == len) {
+				log_mod_line(m, stamp);
+				p++;
+			} else if (o->line_len == MOD_LINE_MAX) {
+				log_mod_line(m, stamp);
+			}
 		}
 	}
-	/* bytes_left can not be 0 here */
-	if (bytes_left < buf_len) {
-		/* Final flush, also ensure that we have newlines */
-		char *lf = memchr(buf, '\n', buf_len);
-		if (!lf)
-			buf[buf_len - bytes_left--] = '\n';
-		write(STDOUT_FILENO, buf, buf_len - bytes_left);
-	}
+	if (!nr)
+		flush_mod_line(m);
+	flush_followers(m);
+	return nr;
 }
 
 /*
- * try_service_sock - Attempt to service the file descriptor as the listen sock
+ * forward_mod_output - Log output from a running module as is
+ *
+ * Nothing is copied. Followers get the pipe's pages teed into theirs, then
+ * the log writer takes them over.
+ *
+ * Returns 0 once the module has closed its end of the pipe.
  */
-static int try_service_socket(int fd)
+static int forward_mod_output(struct module *m)
 {
-	if (fd == manager.listen_sock) {
-		start_new_session(&manager);
-		return 0;
-	}
-	return -1;
-}
+	struct follower *f;
+	int avail;
 
-/*
- * try_service_module - Attempt to service the file descriptor as a module
- */
-static int try_service_module(int fd)
-{
-	int i;
+	/*
+	 * Nothing waiting means a hang up, or a restart earlier on in the
+	 * same batch of events. splice() tells which.
+	 */
+	if (ioctl(m->pipe.fd, FIONREAD, &avail) < 0 || !avail)
+		return log_splice_output(m->pipe.fd, PIPE_BUF);
 
-	for (i = 0; i < NUM_MODS; i++) {
-		if (fd == mods[i]->pipefd) {
-			read_mod_input(fd, mods[i]->mod_name);
-			return 0;
-		}
+	list_for_each_entry(f, &m->followers, list) {
+		ssize_t n = tee(m->pipe.fd, f->pipe[1], avail, SPLICE_F_NONBLOCK);
+
+		f->missed += n > 0 ? avail - n : avail;
 	}
-	return -1;
+	flush_followers(m);
+	return log_splice_output(m->pipe.fd, avail);
 }
 
 /*
- * try_service_session - Attempt to service the file descriptor as a session
+ * module_ready - Log whatever a module had to say
+ *
+ * A module that closed its output is left alone until it is reaped, or
+ * epoll would keep on reporting the hang up.
  */
-static int try_service_session(int fd)
+static void module_ready(struct manager *man, struct event_source *src)
 {
-	struct session *s;
+	struct module *m = container_of(src, struct module, pipe);
 
-	s = get_session_by_fd(&manager, fd);
-	if (!s)
-		return -1;
-	process_session(&manager, s);
-	return 0;
+	/* Disabled earlier on in the same batch of events */
+	if (src->fd < 0)
+		return;
+	if (!(man->raw_output ? forward_mod_output(m) : read_mod_input(m)))
+		manager_unwatch(man, src);
 }
 
 static void early_module_startup(int bot, int server)
@@ -756,110 +1179,24 @@ static void early_module_startup(int bot, int server)
 }
 
 
-/*
- * service_fds - Attempt to service any file descriptors marked ready by poll()
- *
- * Since poll() just marks which file descriptor was ready, we need to match it
- * to a component of the manager (i.e. socket, module, or session).
- */
-static void service_fds(struct pollfd *fds, int npoll, int nready)
-{
-	struct pollfd *fd;
-	int i;
-
-	for (i = 0, fd = fds; i < npoll && nready > 0; i++, fd++) {
-		int errv, readyfd = fd->fd;
-
-		if (!(fd->revents & POLLIN))
-			continue;
-		nready--;
-		errv = try_service_socket(readyfd);
-		if (!errv)
-			continue;
-		errv = try_service_module(readyfd);
-		if (!errv)
-			continue;
-		errv = try_service_session(readyfd);
-		if (!errv)
-			continue;
-
-		logv_err("Could not service fd (%d)!", readyfd);
-	}
-}
-
-/*
- * setup_poll_fds - Prepare the poll() array of file descriptors
- *
- * We will poll() on:
- * 	+ The listen socket file descriptor
- * 	+ All module pipe file descriptors
- * 	+ All currently running client sessions (interactive session)
- */
-static int setup_poll_fds(struct pollfd **fds)
-{
-	struct session *s;
-	struct pollfd *p;
-	int len, i;
-
-	len = 1; /* Start at 1 for the listen sock */
-	len += manager.session_handler->num_sessions;
-	for (i = 0; i < NUM_MODS; i++) {
-		struct module *m = mods[i];
-		if (m->pid > 0)
-			len += 1;
-	}
-
-	p = calloc(len, sizeof(*p));
-	if (!p)
-		diev("malloc() error");
-	if (*fds)
-		free(*fds);
-	*fds = p;
-
-	/* Poll on the listen sock */
-	p->fd = manager.listen_sock;
-	p->events = POLLIN;
-	p++;
-
-	/* Poll on all the current sessions */
-	list_for_each_entry(s, &manager.session_handler->sessions, list) {
-		log_info("Adding session fd (%d) to poll", s->comm_fd);
-		p->fd = s->comm_fd;
-		p->events = POLLIN;
-		p++;
-	}
-
-	/* Poll the currently loaded mods */
-	for (i = 0; i < NUM_MODS; i++) {
-		if (mods[i]->pipefd > 0) {
-			log_info("Adding module '%s' to poll with fd (%d)",
-					mods[i]->mod_name, mods[i]->pipefd);
-			p->fd = mods[i]->pipefd;
-			p->events = POLLIN;
-			p++;
-		}
-	}
-	return len;
-}
-
 /*
  * Check if the manager is "dirty".
  * Shorthand word for that some state has changed that needs to be accounted for.
  */
 static inline int manager_is_dirty(void)
 {
-	return manager.mods_dirty ||
-		manager.session_handler->sessions_dirty;
+	return manager.mods_dirty;
 }
 
 /*
- * manager_cleanup_dirt - Cleanup the dirty states so we correctly poll.
+ * manager_cleanup_dirt - Cleanup the dirty states
  *
  * If the manager is "dirty" that means a state has chagned in which we need
- * to account for. Most notably it needs to be accounted for in our call to
- * poll(). Events that make the manager dirty:
+ * to account for. Events that make the manager dirty:
  * 	- starting or disabling modules
- * 	- starting or stopping sessions (dirty sessions handled by session handler)
+ * 	- modules dying
+ * Fds coming and going need no cleanup, they (un)register themselves with
+ * manager_watch() and manager_unwatch().
  */
 static void manager_cleanup_dirt(void)
 {
@@ -867,19 +1204,9 @@ static void manager_cleanup_dirt(void)
 
 	intr_save(flags);
 	restart_mods();
-	manager.session_handler->sessions_dirty = 0;
 	intr_restore(flags);
 }
 
-/*
- * destory_poll_fds - Deallocate the array of poll file descriptors
- */
-static void destroy_poll_fds(struct pollfd *fds)
-{
-	if (fds)
-		free(fds);
-}
-
 /*
  * Main manager loop.
  *
@@ -890,10 +1217,10 @@ static void destroy_poll_fds(struct pollfd *fds)
  * 	+ Have a working local Unix socket for IPC and receiving commands
  * 	+ Registered a child death signal handler
  *
- * Next step is to setup poll(). We call on setup_poll_fds() to populate
- * our array of file descriptors, then poll().
- *
- * If poll() returns a ready file descriptor, we move on to service it.
+ * Every file descriptor we wait on (listen socket, module pipes, sessions)
+ * was registered with epoll by whoever owns it, along with its
+ * event_source. So when epoll_wait() says an fd is ready, its owner is
+ * called straight away without looking anything up.
  *
  * Important things to remember:
  *  - We could possbily halt the execution of this loop from an event. More
@@ -902,32 +1229,31 @@ static void destroy_poll_fds(struct pollfd *fds)
  */
 static void start_manager_loop(void)
 {
-	struct pollfd *fds = NULL;
-	int nfds;
+	struct epoll_event events[MAN_MAX_EVENTS];
 
-	nfds = setup_poll_fds(&fds);
 	while (manager.status == RUNNING) {
-		int readyfd;
+		int i, nready;
 
 		/* Check for any state change */
 		if (manager_is_dirty()) {
 			manager_cleanup_dirt();
-			nfds = setup_poll_fds(&fds);
 			continue;
 		}
 
-		readyfd = poll(fds, nfds, MAN_POLL_TIMEOUT);
-		if (!readyfd)
-			continue;
-		if (readyfd < 0) {
+		nready = epoll_wait(manager.epoll_fd, events, MAN_MAX_EVENTS,
+				    MAN_POLL_TIMEOUT);
+		if (nready < 0) {
 			if (errno != EINTR)
-				logv_err("poll fail");
+				logv_err("epoll_wait fail");
 			continue;
 		}
 
-		service_fds(fds, nfds, readyfd);
+		for (i = 0; i < nready; i++) {
+			struct event_source *src = events[i].data.ptr;
+
+			src->ready(&manager, src);
+		}
 	}
-	destroy_poll_fds(fds);
 	shutdown_manager();
 }
 
@@ -956,7 +1282,7 @@ int main(int argc, char **argv)
 		usage(self_name);
 
 	disable_sigpipe();
-	while ((opt = getopt(argc, argv, "abis:S:w")) != -1) {
+	while ((opt = getopt(argc, argv, "abirs:S:w")) != -1) {
 		switch (opt) {
 		case 'a':
 			should_init_server = 1;
@@ -968,6 +1294,9 @@ int main(int argc, char **argv)
 		case 'i':
 			start_interactive();
 			return 0;
+		case 'r':
+			manager.raw_output = 1;
+			break;
 		case 's':
 		case 'S':
 			if (try_send((const char **) argv, optind))
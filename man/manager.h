@@ -1,18 +1,66 @@
 #ifndef _MANAGER_H_
 #define _MANAGER_H_
+#include <stddef.h>
+#include <stdint.h>
 #include <time.h>
+#include "list.h"
 
 #ifndef SUN_LEN
 # define SUN_LEN(su) \
 	(sizeof(*(su)) - sizeof((su)->sun_path) + strlen((su)->sun_path))
 #endif
 #define ARRAY_SIZE(arr) (sizeof(arr) / sizeof((arr)[0]))
+#define container_of(ptr, type, member) \
+	((type *) ((void *) (ptr) - offsetof(type, member)))
 
 #define MAX_CMD_LEN 4096
+/* Most bytes kept per module for "tail", nothing the manager says is longer */
+#define MOD_HISTORY_SIZE (1 << 17)
 #define NUM_MODS 2
 #define MANAGER_SOCK_PATH "/tmp/ts_manager_sock"
 
 struct session_handler;
+struct manager;
+
+/*
+ * event_source - A file descriptor the manager waits on
+ *
+ * Whatever owns the fd (the listen socket, a module, a session) embeds one
+ * of these, and epoll hands it straight back when the fd is ready. The
+ * owner gets back to itself with container_of(), so nothing ever has to
+ * be looked up by fd.
+ */
+struct event_source {
+	/* fd - The file descriptor being waited on, -1 if none */
+	int fd;
+
+	/* ready - Called once fd is readable, hung up, or in error */
+	void (*ready)(struct manager *man, struct event_source *src);
+};
+
+/*
+ * follower - A session being sent a module's output as it comes ("follow")
+ *
+ * Output goes into pipe first, and is spliced on from there to sock. The
+ * manager never waits on a follower: whatever sock has no room for is
+ * thrown away, and counted in missed.
+ */
+struct follower {
+	/* list - On the list of followers of the module being followed */
+	struct list_node list;
+
+	/* sock - The session's (non-blocking) socket, -1 while it is busy */
+	int sock;
+
+	/* pipe - Output on its way to sock, both ends -1 if not following */
+	int pipe[2];
+
+	/* mod_name - The module being followed */
+	const char *mod_name;
+
+	/* missed - Bytes of output thrown away so far */
+	uint64_t missed;
+};
 
 enum manager_status {
 	STARTING,
@@ -26,8 +74,11 @@ enum manager_status {
  * Keeps track of the state of the running manager.
  */
 struct manager {
-	/* listen_sock - file descriptor for it's listening socket */
-	int listen_sock;
+	/* listen_sock - it's listening socket */
+	struct event_source listen_sock;
+
+	/* epoll_fd - Where every event_source is registered */
+	int epoll_fd;
 
 	/*
 	 * running - is the manager currently running. 0 or 1 only
@@ -42,6 +93,12 @@ struct manager {
 	 */
 	volatile unsigned int mods_dirty;
 
+	/*
+	 * raw_output - Forward module output to the log as is, instead of
+	 * framing it into timestamped lines
+	 */
+	unsigned int raw_output;
+
 	/* session_handler - The "manager" of sessions */
 	struct session_handler *session_handler;
 
@@ -50,6 +107,10 @@ struct manager {
 };
 
 /* Only here to expose functionality to the session_handler */
-extern const char *manager_process_input(char *);
+extern const char *manager_process_input(char *, struct follower *);
+extern void manager_unfollow(struct follower *f);
+extern int manager_watch(struct manager *man, struct event_source *src);
+extern void manager_unwatch(struct manager *man, struct event_source *src);
+extern int manager_watch_output(struct manager *man, struct event_source *src, int output);
 
 #endif
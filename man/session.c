@@ -1,4 +1,6 @@
+#define _GNU_SOURCE
 #include <arpa/inet.h>
+#include <errno.h>
 #include <poll.h>
 #include <stdio.h>
 #include <stdint.h>
@@ -13,27 +15,39 @@
 
 #define MANAGER_SOCK_PATH "/tmp/ts_manager_sock"
 
+static void session_ready(struct manager *man, struct event_source *src);
+
 /*
  * __start_new_session - Allocate resources for a new sesssion
  */
-static int __start_new_session(struct session_handler *sh, int sock)
+static int __start_new_session(struct manager *man)
 {
+	struct session_handler *sh = man->session_handler;
 	struct session *new;
 
 	new = malloc(sizeof(*new));
 	if (!new)
 		goto bad_mem;
 
-	new->comm_fd = accept(sock, NULL, NULL);
-	if (new->comm_fd < 0)
+	/* The manager loop must never wait on a session, see send_reply() */
+	new->comm.fd = accept4(man->listen_sock.fd, NULL, NULL, SOCK_NONBLOCK);
+	if (new->comm.fd < 0)
 		goto bad_accept;
+	new->comm.ready = session_ready;
+	if (manager_watch(man, &new->comm) < 0)
+		goto bad_watch;
 
 	new->cmd_len = 0;
+	new->len_read = 0;
 	new->buf_tail = new->buf;
+	new->reply = NULL;
+	new->follower.sock = new->comm.fd;
+	new->follower.pipe[0] = new->follower.pipe[1] = -1;
 	list_add_post(&new->list, &sh->sessions);
 	sh->num_sessions++;
-	sh->sessions_dirty = 1;
 	return 0;
+bad_watch:
+	close(new->comm.fd);
 bad_accept:
 	free(new);
 bad_mem:
@@ -46,50 +60,119 @@ bad_mem:
  */
 void start_new_session(struct manager *man)
 {
-	__start_new_session(man->session_handler, man->listen_sock);
+	__start_new_session(man);
+}
+
+/*
+ * send_reply - Send as much of the reply as the socket takes right now
+ *
+ * Returns 1 if some of it is still left, 0 once it is all out, or -1 if
+ * the session is gone.
+ */
+static int send_reply(struct session *s)
+{
+	while (s->reply_sent < s->reply_len) {
+		ssize_t nw = write(s->comm.fd, s->reply + s->reply_sent,
+				   s->reply_len - s->reply_sent);
+
+		if (nw < 0) {
+			if (errno == EINTR)
+				continue;
+			return errno == EAGAIN ? 1 : -1;
+		}
+		s->reply_sent += nw;
+	}
+	free(s->reply);
+	s->reply = NULL;
+	return 0;
 }
 
 /*
  * process_command - Process the input from a sesssion
  *
  * This is only invoked when all the bytes have been received!
+ *
+ * The response goes back the same way commands come in, its length (in
+ * big endian) followed by that many bytes, since it may not fit in a
+ * single read() on the other end. Whatever the socket has no room for
+ * is sent once it does, and until then no more commands are read.
+ *
+ * Returns 0 if the session is gone.
  */
-static void process_command(struct session *s)
+static int process_command(struct manager *man, struct session *s)
 {
 	const char *resp;
+	uint32_t len;
+	int err;
 
 	s->cmd_len = 0;
 	s->buf_tail = s->buf;
-	resp = manager_process_input(s->buf);
-	write(s->comm_fd, resp, strlen(resp));
+	resp = manager_process_input(s->buf, &s->follower);
+	len = strlen(resp);
+	s->reply = malloc(sizeof(len) + len);
+	if (!s->reply)
+		return 0;
+	s->reply_len = sizeof(len) + len;
+	s->reply_sent = 0;
+	len = htonl(len);
+	memcpy(s->reply, &len, sizeof(len));
+	memcpy(s->reply + sizeof(len), resp, s->reply_len - sizeof(len));
+
+	err = send_reply(s);
+	if (err > 0) {
+		/* Module output can't go out in the middle of the reply */
+		s->follower.sock = -1;
+		return !manager_watch_output(man, &s->comm, 1);
+	}
+	return !err;
 }
 
 /*
  * __process_session - Read in the connection to a session
  */
-static int __process_session(struct session_handler *sh, struct session *sess)
+static int __process_session(struct manager *man, struct session *sess)
 {
 	int res;
 
+	/* Still sending the last reply */
+	if (sess->reply) {
+		res = send_reply(sess);
+		if (res)
+			return res > 0;
+		sess->follower.sock = sess->comm.fd;
+		return !manager_watch_output(man, &sess->comm, 0);
+	}
+
 	/*
 	 * If cmd_len is 0, this is a new session or we are waiting for a
-	 * new command
+	 * new command. Its length may come in bits like the rest of it.
 	 */
 	if (!sess->cmd_len) {
-		uint32_t len;
-		res = read(sess->comm_fd, &len, sizeof(len));
+		res = read(sess->comm.fd, (char *) &sess->len_buf + sess->len_read,
+			   sizeof(sess->len_buf) - sess->len_read);
+		if (res < 0 && (errno == EAGAIN || errno == EINTR))
+			return 1;
 		if (res <= 0)
 			return 0;
-		sess->cmd_len = ntohl(len);
+		sess->len_read += res;
+		if (sess->len_read < sizeof(sess->len_buf))
+			return 1;
+		sess->len_read = 0;
+		sess->cmd_len = ntohl(sess->len_buf);
 		if (sess->cmd_len == -1 || sess->cmd_len >= MAX_CMD_LEN)
 			return 0;
 		sess->bytes_read = 0;
 	}
 
 	if (sess->cmd_len) {
-		uint32_t header_size = sizeof(sess->cmd_len);
-
-		res = read(sess->comm_fd, sess->buf_tail, MAX_CMD_LEN - header_size - 1);
+		/*
+		 * Only what is left of this command, the next one may already
+		 * be right behind it
+		 */
+		res = read(sess->comm.fd, sess->buf_tail,
+			   sess->cmd_len - sess->bytes_read);
+		if (res < 0 && (errno == EAGAIN || errno == EINTR))
+			return 1;
 		if (res <= 0)
 			return 0;
 
@@ -97,7 +180,7 @@ static int __process_session(struct session_handler *sh, struct session *sess)
 		sess->bytes_read += res;
 		*sess->buf_tail = '\0';
 		if (sess->bytes_read == sess->cmd_len)
-			process_command(sess);
+			return process_command(man, sess);
 	}
 	return 1;
 }
@@ -107,39 +190,26 @@ static int __process_session(struct session_handler *sh, struct session *sess)
  *
  * Close the communication file descriptor and remove it from the list of sessions
  */
-static void close_session(struct session_handler *sh, struct session *s)
+static void close_session(struct manager *man, struct session *s)
 {
-	close(s->comm_fd);
+	manager_unwatch(man, &s->comm);
+	manager_unfollow(&s->follower);
+	close(s->comm.fd);
+	free(s->reply);
 	list_del(&s->list);
 	free(s);
-	sh->num_sessions--;
-	sh->sessions_dirty = 1;
-}
-
-/*
- * process_session - Callpoint for manager to process a session
- */
-void process_session(struct manager *man, struct session *s)
-{
-	struct session_handler *sh = man->session_handler;
-
-	if (!__process_session(sh, s))
-		close_session(sh, s);
+	man->session_handler->num_sessions--;
 }
 
 /*
- * get_session_by_fd - Return a pointer to a session, looked up by its fd
+ * session_ready - Callpoint for manager to process a session
  */
-struct session *get_session_by_fd(struct manager *man, int fd)
+static void session_ready(struct manager *man, struct event_source *src)
 {
-	struct session_handler *sh = man->session_handler;
-	struct session *s;
+	struct session *s = container_of(src, struct session, comm);
 
-	list_for_each_entry(s, &sh->sessions, list) {
-		if (s->comm_fd == fd)
-			return s;
-	}
-	return NULL;
+	if (!__process_session(man, s))
+		close_session(man, s);
 }
 
 /*
@@ -151,7 +221,7 @@ void close_session_handler(struct manager *man)
 	struct session *s, *to_free;
 
 	list_for_each_entry_safe(to_free, s, &sh->sessions, list)
-		close_session(sh, s);
+		close_session(man, to_free);
 }
 
 /*
@@ -13,11 +13,26 @@ struct session {
 	/* cmd_len - The length of the command/message being received */
 	uint32_t cmd_len;
 
+	/* len_buf - The length of the next command, len_read bytes of it so far */
+	uint32_t len_buf;
+	size_t len_read;
+
 	/* bytes_read - The amount of bytes read so far */
 	size_t bytes_read;
 
-	/* comm_fd - The file descriptor to communicate through */
-	int comm_fd;
+	/* comm - The file descriptor to communicate through */
+	struct event_source comm;
+
+	/* follower - Set up if the session asked to follow a module */
+	struct follower follower;
+
+	/*
+	 * reply - Reply the socket had no room for yet, with its length up
+	 * front. reply_sent is how much of it went out so far.
+	 */
+	char *reply;
+	size_t reply_len;
+	size_t reply_sent;
 
 	/* buf_tail - The next byte to be written to for successive reads() */
 	char *buf_tail;
@@ -35,19 +50,11 @@ struct session_handler {
 
 	/* num_sessions - Number of sessions in the list */
 	unsigned int num_sessions;
-
-	/*
-	 * sessions_dirty - Marked if the manager needs to take note of a
-	 * change of state
-	 */
-	int sessions_dirty;
 };
 
 extern void *start_session_handler(void *);
 extern void start_new_session(struct manager *);
-extern void process_session(struct manager *man, struct session *s);
 extern int init_session_handler(struct manager *man);
 extern void close_session_handler(struct manager *man);
-extern struct session *get_session_by_fd(struct manager *man, int fd);
 
 #endif
@@ -0,0 +1,124 @@
+#!/usr/bin/env python3
+#
+# Talks to a manager the way its sessions can be talked to, but never are
+# by ./manager -s: several commands in a single write(), and one command
+# dribbled in a byte at a time. Every command has to get its own reply.
+#
+# Starts a manager of its own (with a stand-in webserver module) in a
+# scratch directory, so no manager may be running already.
+#
+# usage: ./test_sessions.py [path to manager]
+
+import os
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+
+SOCK_PATH = "/tmp/ts_manager_sock"
+
+FAKE_WEBSERVER = """#!/bin/sh
+i=0
+while :; do i=$((i+1)); echo "request $i"; sleep 0.01; done
+"""
+
+
+def frame(cmd):
+    return struct.pack("!I", len(cmd)) + cmd
+
+
+def read_reply(s):
+    n = struct.unpack("!I", s.recv(4, socket.MSG_WAITALL))[0]
+    reply = s.recv(n, socket.MSG_WAITALL)
+    if len(reply) != n:
+        raise RuntimeError("short reply")
+    return reply.decode()
+
+
+def connect():
+    s = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    s.settimeout(5)
+    s.connect(SOCK_PATH)
+    return s
+
+
+def check(what, ok):
+    print("%s: %s" % ("ok" if ok else "FAILED", what))
+    return ok
+
+
+def run_tests():
+    ok = True
+
+    # Back to back, all in one write()
+    s = connect()
+    s.sendall(frame(b"tail webserver 1") + frame(b"bogus") +
+              frame(b"tail webserver 3"))
+    replies = [read_reply(s) for _ in range(3)]
+    s.close()
+    ok &= check("first of three commands in one write",
+                replies[0].count("\n") == 0 and "request" in replies[0])
+    ok &= check("second of three commands in one write",
+                replies[1] == "Unknown command.")
+    ok &= check("third of three commands in one write",
+                replies[2].count("\n") == 2)
+
+    # One command, a byte at a time, followed by another
+    s = connect()
+    for b in frame(b"tail webserver 2"):
+        s.send(bytes([b]))
+        time.sleep(0.005)
+    s.sendall(frame(b"bogus"))
+    replies = [read_reply(s) for _ in range(2)]
+    s.close()
+    ok &= check("command sent a byte at a time",
+                replies[0].count("\n") == 1)
+    ok &= check("command after one sent a byte at a time",
+                replies[1] == "Unknown command.")
+
+    # The session is dropped, not overflowed, by a command that is too long
+    s = connect()
+    s.sendall(struct.pack("!I", 1 << 20) + b"x" * 4096)
+    try:
+        dropped = s.recv(1) == b""
+    except OSError:
+        dropped = True
+    s.close()
+    ok &= check("command longer than allowed drops the session", dropped)
+    return ok
+
+
+def main():
+    manager = os.path.abspath(sys.argv[1] if len(sys.argv) > 1 else "./manager")
+
+    if os.path.exists(SOCK_PATH):
+        sys.exit("A manager seems to be running already (%s exists)" % SOCK_PATH)
+
+    with tempfile.TemporaryDirectory() as scratch:
+        module = os.path.join(scratch, "webserver", "tswebserver")
+        os.mkdir(os.path.dirname(module))
+        with open(module, "w") as f:
+            f.write(FAKE_WEBSERVER)
+        os.chmod(module, 0o755)
+
+        subprocess.run([manager, "-w"], cwd=scratch, check=True)
+        try:
+            for _ in range(100):
+                if os.path.exists(SOCK_PATH):
+                    break
+                time.sleep(0.05)
+            # Give the module time to say something to "tail"
+            time.sleep(0.5)
+            try:
+                ok = run_tests()
+            except (OSError, RuntimeError) as e:
+                ok = check("talking to the manager (%s)" % e, False)
+        finally:
+            subprocess.run([manager, "-s", "stop"], stdout=subprocess.DEVNULL)
+    sys.exit(0 if ok else 1)
+
+
+if __name__ == "__main__":
+    main()
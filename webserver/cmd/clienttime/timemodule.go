@@ -2,29 +2,70 @@ package clienttime
 
 import (
 	"bytes"
+	"encoding/json"
+	"fmt"
+	"io"
+	"log"
+	"net"
 	"os"
 	"os/exec"
 	"strconv"
 	"strings"
+	"time"
 	"tswebserver/cmd/config"
 )
 
 const (
-	rustLtcExe  = "./../ltc/target/release/ltc"
-	cLtcExe = "./../ltc/old_ltc/ltc"
-	logsDir = "./../logs"
-	numClients = 13
+	rustLtcExe    = "./../ltc/target/release/ltc"
+	cLtcExe       = "./../ltc/old_ltc/ltc"
+	logsDir       = "./../logs"
+	ltcCheckpoint = "./../ltc/old_ltc/ltc.ckpt"
+	ltcIndex      = "./../ltc/old_ltc/ltc.idx"
+	ltcSocket     = "/tmp/ltc_sock"
+	numClients    = 13
 )
 
 type timeConfig struct {
 	enabled bool
-	prog string
-	exe string
+	prog    string
+	exe     string
 }
 
 type ClientTimeEntry struct {
-	TotalTime  uint64
-	ClientName string
+	TotalTime   uint64
+	ClientName  string
+	ClientId    uint32
+	Connections uint64
+}
+
+/* ltcJsonEntry is a single client, as printed by `ltc -o json` */
+type ltcJsonEntry struct {
+	Id          uint32 `json:"id"`
+	Name        string `json:"name"`
+	Time        uint64 `json:"time"`
+	Connections uint64 `json:"connections"`
+}
+
+/*
+ * queryLtcServer asks an already running `ltc --serve` for the client times,
+ * which saves starting up ltc on every request.
+ */
+func queryLtcServer() (string, error) {
+	conn, err := net.DialTimeout("unix", ltcSocket, time.Second)
+	if err != nil {
+		return "", err
+	}
+	defer conn.Close()
+	conn.SetDeadline(time.Now().Add(5 * time.Second))
+
+	if _, err = fmt.Fprintf(conn, "top %d json\n", numClients); err != nil {
+		return "", err
+	}
+	resp, err := io.ReadAll(conn)
+	if err != nil {
+		return "", err
+	}
+	return string(resp), nil
 }
 
 func fetchClientTime() string {
@@ -32,10 +73,14 @@ func fetchClientTime() string {
 	var cmd *exec.Cmd
 	prog := config.Config.ClientTimeConf.Prog
 
-
 	if prog == "C" {
+		if resp, err := queryLtcServer(); err == nil {
+			return resp
+		}
+
 		clientsToPrint := strconv.Itoa(numClients)
-		cmd = exec.Command(cLtcExe, "-h", clientsToPrint, "-s", logsDir)
+		cmd = exec.Command(cLtcExe, "-m", "-c", ltcCheckpoint, "-i", ltcIndex,
+			"-h", clientsToPrint, "-o", "json", logsDir)
 	} else {
 		cmd = exec.Command(rustLtcExe, logsDir)
 	}
@@ -45,28 +90,64 @@ func fetchClientTime() string {
 	return string(stdout.Bytes())
 }
 
-func BuildClientTimes() []ClientTimeEntry {
+/*
+ * parseJsonTimes reads the client times the C ltc prints with -o json.
+ */
+func parseJsonTimes(out string) []ClientTimeEntry {
+	var parsed []ltcJsonEntry
 	var entries []ClientTimeEntry = nil
-	if !config.Config.ClientTimeConf.Enabled {
-		return make([]ClientTimeEntry, 0)
-	}
 
-	times := strings.Split(fetchClientTime(), "\n")
-	for i, line := range times {
+	if err := json.Unmarshal([]byte(out), &parsed); err != nil {
+		log.Printf("Failed to parse ltc output: %v\n", err)
+		return nil
+	}
+	for i, e := range parsed {
 		if i >= numClients {
 			break
 		}
+		entries = append(entries, ClientTimeEntry{
+			TotalTime:   e.Time,
+			ClientName:  e.Name,
+			ClientId:    e.Id,
+			Connections: e.Connections,
+		})
+	}
+	return entries
+}
+
+/*
+ * parseTextTimes reads "<seconds>\t<name>" lines, as printed by the rust ltc.
+ * Lines that don't look like that are skipped.
+ */
+func parseTextTimes(out string) []ClientTimeEntry {
+	var entries []ClientTimeEntry = nil
 
-		timeNameSplit := strings.Split(line, "\t")
-		if len(line) <= 0 {
+	for _, line := range strings.Split(out, "\n") {
+		if len(entries) >= numClients {
+			break
+		}
+
+		timeNameSplit := strings.SplitN(line, "\t", 2)
+		if len(timeNameSplit) != 2 {
 			continue
 		}
 		time, err := strconv.ParseUint(timeNameSplit[0], 10, 64)
 		if err != nil {
-			panic(err)
+			log.Printf("Skipping bad ltc line %q: %v\n", line, err)
+			continue
 		}
-		name := timeNameSplit[1]
-		entries = append(entries, ClientTimeEntry{TotalTime: time, ClientName: name})
+		entries = append(entries, ClientTimeEntry{TotalTime: time, ClientName: timeNameSplit[1]})
 	}
 	return entries
 }
+
+func BuildClientTimes() []ClientTimeEntry {
+	if !config.Config.ClientTimeConf.Enabled {
+		return make([]ClientTimeEntry, 0)
+	}
+
+	if config.Config.ClientTimeConf.Prog == "C" {
+		return parseJsonTimes(fetchClientTime())
+	}
+	return parseTextTimes(fetchClientTime())
+}